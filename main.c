@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -16,6 +27,34 @@
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define TAB_SIZE 4
 #define QUIT_TIMES 2
+#define IDLE_SLICE_US 8000
+#define SAVE_IOVECS 1024
+#define LOAD_MAX_THREADS 16
+#define LOAD_MIN_CHUNK (1024 * 1024)
+#define ZBLOCK_SIZE (64 * 1024)
+#define ZBLOCK_MAX_LINES 4096
+#define ZHASH_BITS 12
+#define STREAM_CHUNK (64 * 1024)
+#define IDLE_REDRAW_US 50000
+#define FOLLOW_CHECK_US 1000000
+#define DISK_CHECK_US 1000000
+#define RELOAD_MAX_D 2048
+#define VIEW_CHECKPOINT 1024
+#define VIEW_WINDOW 2048
+#define VIEW_SCAN_CHUNK (1024 * 1024)
+#define UNDO_DEFAULT_LIMIT (64 * 1024 * 1024)
+#define MACRO_MAX_DEPTH 64
+#define LEX_VERSION 1
+#define LEX_MAX_STRINGS 8
+#define LEX_DELIM 8
+#define LEX_MAX_STATES 65535
+#define HL_BACKSCAN 1000
+#define HL_MIN_CHUNK 16384
+#define BR_BLOCK 256
+#define INPUT_RING 1024
+#define INDEX_VERSION 3
+#define INDEX_MIN_SIZE (1024 * 1024)
+#define SERVER_NOTICE "\x1b]shabi;"
 
 #define EDT true
 #define CMD false
@@ -57,7 +96,9 @@ enum ekeys {
     vk_home,
     vk_end,
     vk_pageup,
-    vk_pagedown
+    vk_pagedown,
+    vk_detach,
+    vk_resize
 };
 
 enum eHighlight {
@@ -73,19 +114,82 @@ enum eHighlight {
     HLDollar
 };
 
-#define HL_HIGHLIGHT_NUMBERS (1 << 0)
-#define HL_HIGHLIGHT_STRINGS (1 << 1)
+//What a lexer state accepts when a token ends there.
+enum elextoken {
+    LexNone,
+    LexKeyword,
+    LexType,
+    LexMacro,
+    LexComment,
+    LexBlock,
+    LexString
+};
+
+//The state a line leaves the lexer in. Values from LexInString up are inside that string rule.
+enum elexstate {
+    LexInCode,
+    LexInBlock,
+    LexInString
+};
+
+typedef struct elexstring {
+    char open[LEX_DELIM];
+    char close[LEX_DELIM];
+    char interpOpen[LEX_DELIM];
+    char interpClose[LEX_DELIM];
+    char escape;
+    bool multiline;
+    //The table state of the word the string has to follow on its line, or 0 if it can go anywhere.
+    int after;
+} elexstring;
+
+//A language definition compiled into a state transition table. Bytes map to classes and every token starts from
+//state 1; state 0 is dead. The table and the per-state accept kinds and args follow the header in the same
+//allocation, so the whole thing goes to and from the cache as is.
+typedef struct elexer {
+    char magic[4];
+    int version;
+    unsigned long long hash;
+    int size;
+    int classes;
+    int states;
+    unsigned char cls[256];
+    char blockEnd[LEX_DELIM];
+    bool numbers;
+    int stringCount;
+    elexstring strings[LEX_MAX_STRINGS];
+} elexer;
 
 typedef struct editorSyntax {
     char *filetype;
     char **filematch;
-    char **keywords;
-    char *singleLineCommentStart;
-    char *multilineCommentStart;
-    char *multilineCommentEnd;
-    int flags;
+    char *def;
+    unsigned long long hash;
+    elexer *lex;
 } editorSyntax;
 
+//A run of cold lines compressed together. The raw block is each line's data followed by a '\0'. The compressed bytes
+//follow the header in the same allocation.
+typedef struct ezblock {
+    int refs;
+    int rawlen;
+    int zlen;
+} ezblock;
+
+//The brackets a run of lines leaves unmatched, closing ones first: ")))(((".
+typedef struct ebracket {
+    int open;
+    int close;
+} ebracket;
+
+//A run of lines in the bracket index. sum is what they leave unmatched together, worked out again when it's next
+//needed after one of them changed.
+typedef struct ebrblock {
+    int count;
+    ebracket sum;
+    bool dirty;
+} ebrblock;
+
 typedef struct eline {
     int idx;
     int size;
@@ -94,8 +198,259 @@ typedef struct eline {
     char *rdata;
     unsigned char *hl;
     int hlOpenComment;
+    bool hlExact;
+    ebracket br;
+    int uid;
+    int cowSeq;
+    bool modified;
+    bool stale;
+    ezblock *zblock;
+    int zoff;
 } eline;
 
+#define TRIGRAM_BUCKETS (1 << 18)
+#define TRIGRAM_AUTO_SIZE (64 * 1024 * 1024)
+
+//Posting lists hold line uids, varint delta encoded. A line gets a fresh uid every time it's indexed so the lists stay sorted
+//and retired uids (uidIdx == -1) are just skipped when querying.
+typedef struct eposting {
+    unsigned char *buf;
+    int len;
+    int cap;
+    int last;
+} eposting;
+
+typedef struct etrigram {
+    eposting *buckets;
+    int *uidIdx;
+    int uidCount;
+    int uidCap;
+    int next;
+    int dead;
+    unsigned int gen;
+    char *cacheQuery;
+    unsigned int cacheGen;
+    int *cand;
+    int candCount;
+} etrigram;
+
+typedef struct esaveline {
+    char *data;
+    int size;
+    ezblock *zblock;
+    int zoff;
+} esaveline;
+
+//A save running on a writer thread. The writer only sees the snapshot of line data pointers taken when the save started.
+//While it's running, lines from before the snapshot are copy on write: editing or freeing one hands its old data to
+//the orphans list, which is freed once the writer is done.
+typedef struct esavejob {
+    pthread_t thread;
+    bool active;
+    char *filename;
+    esaveline *lines;
+    int count;
+    long long total;
+    long long written;
+    int done;
+    long long result;
+    int err;
+    int dirty;
+    int undoCount;
+    char **orphans;
+    int orphanCount;
+    int orphanCap;
+} esavejob;
+
+//A file being read in the background from stdin or a FIFO. The reader thread fills buf, the idle hook drains it.
+typedef struct estream {
+    pthread_t thread;
+    bool active;
+    char *path;
+    int fd;
+    int wake[2];
+    pthread_mutex_t lock;
+    char *buf;
+    int len;
+    int cap;
+    bool eof;
+    int err;
+    char *pending;
+    int pendingLen;
+    int pendingOff;
+    char *partial;
+    int partialLen;
+    long long bytes;
+} estream;
+
+//Keys decoded on the input thread wait here for the main thread. head is only written by the input thread and tail only
+//by the main one. Every key pushed also puts a byte in the wake pipe, so the main thread can sleep in poll.
+typedef struct einput {
+    pthread_t thread;
+    bool active;
+    int wake[2];
+    int keys[INPUT_RING];
+    unsigned int head;
+    unsigned int tail;
+} einput;
+
+//The render thread owns the terminal. A finished frame waits in the mailbox until it's written, and a newer one
+//replaces it, since every frame redraws the whole screen.
+typedef struct erender {
+    pthread_t thread;
+    bool active;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *frame;
+    int len;
+    bool writing;
+} erender;
+
+//A server keeps its buffers between clients, and listen is -1 when this isn't one. While a client is attached its
+//socket is stdin and stdout, otherwise they're /dev/null. The input thread sits on the attach pipe in between.
+typedef struct eserver {
+    int listen;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int attach[2];
+    bool attached;
+    int w;
+    int h;
+} eserver;
+
+//The first thing a client sends: its terminal's size, then pathLen bytes of the file to open.
+typedef struct ehello {
+    int w;
+    int h;
+    int pathLen;
+} ehello;
+
+//Follow mode keeps the file open and appends whatever gets written to its end.
+typedef struct efollow {
+    bool active;
+    int fd;
+    int inotify;
+    long long offset;
+    bool tailOpen;
+    long long lastCheck;
+} efollow;
+
+//A read-only view of a file too big to load. Only a window of lines around the cursor is kept in memory. A background
+//pass records where every VIEW_CHECKPOINT'th line starts, so any line can be reached with one seek and a short scan.
+typedef struct eview {
+    bool active;
+    int fd;
+    long long size;
+    long long start;
+    long long end;
+    long long base;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    long long *checkpoints;
+    int checkpointCount;
+    int checkpointCap;
+    long long scanned;
+    long long total;
+    int done;
+    int stop;
+    bool doneShown;
+} eview;
+
+enum eundotype {
+    UndoInsText,
+    UndoDelText,
+    UndoInsLines,
+    UndoDelLines,
+    UndoMoveLines
+};
+
+//One primitive edit. Its text lives in the undo arena; line records keep each line followed by a newline. A move has
+//no text: the lines [line, line + count) were rotated so the one at line + col came first.
+typedef struct eundorec {
+    char type;
+    int group;
+    int line;
+    int col;
+    int count;
+    long long off;
+    int len;
+} eundorec;
+
+//The edit history. Records [0, count) are applied and [count, total) can be redone. Records in the same group are
+//undone together.
+typedef struct eundo {
+    eundorec *recs;
+    int count;
+    int total;
+    int cap;
+    char *text;
+    long long textLen;
+    long long textCap;
+    int group;
+    bool open;
+    int suspend;
+    int savedCount;
+    long long limit;
+} eundo;
+
+//Lines edited inside a transaction. They get rendered and highlighted once, when it commits.
+typedef struct etxn {
+    int depth;
+    int *lines;
+    int count;
+    int cap;
+} etxn;
+
+//An extra cursor. The primary one stays in editorInfo.cx/cy.
+typedef struct ecursor {
+    int cx, cy;
+    int tx;
+} ecursor;
+
+//The yank register. Its lines sit back to back in one buffer, each followed by a newline.
+typedef struct eregister {
+    char *text;
+    int len;
+    int cap;
+    int count;
+} eregister;
+
+//A keyboard macro. Keys are kept the way eReadKey returns them.
+typedef struct emacro {
+    int *keys;
+    int len;
+    int cap;
+} emacro;
+
+//The macro being replayed. eReadKey hands out its keys before it looks at the terminal.
+typedef struct ereplay {
+    int *keys;
+    int len;
+    int pos;
+    int times;
+    int depth;
+    bool failed;
+} ereplay;
+
+//A file's sidecar index in the cache directory, written once the file's highlighting is done so the next open can skip
+//the background highlighting pass. Each line's state follows, then its brackets. They're only used if the content
+//still hashes the same.
+typedef struct eindex {
+    char magic[4];
+    int version;
+    long long size;
+    long long mtime;
+    unsigned long long hash;
+    unsigned long long lexHash;
+    int lines;
+} eindex;
+
+//The file an index is being kept for. eLoadLines hashes the content while it reads it.
+typedef struct eloadindex {
+    unsigned long long hash;
+    long long size;
+    long long mtime;
+} eloadindex;
+
 struct editorInfo {
     int cx, cy;
     int rx;
@@ -105,8 +460,14 @@ struct editorInfo {
     int w;
     int h;
     int linecount;
+    int linecap;
     int dirty;
+    unsigned int generation;
     char *filename;
+    long long fileSize;
+    long long fileMtime;
+    bool diskChanged;
+    long long diskCheck;
     char *filenameTrunc;
     char statusmsg[80];
     time_t statusmsgTime;
@@ -118,11 +479,34 @@ struct editorInfo {
     bool showLineNumbers;
     int maxLineLen;
     bool useTrueTab;
+    bool useTrigram;
+    etrigram *trigram;
+    int snapshotSeq;
+    char *arena;
+    long long arenaSize;
+    int arenaRefs;
+    bool compress;
+    int zNext;
+    int zTouched;
+    int hlFrontier;
+    bool hlResume;
+    ebrblock *brBlocks;
+    int brBlockCount;
+    int brBlockCap;
+    int brHint;
+    int brHintStart;
+    bool brDirty;
+    eloadindex *index;
+    eundo undo;
+    ecursor *cursors;
+    int cursorCount;
+    int cursorCap;
 };
 
 typedef struct abuf {
     char *b;
     int len;
+    int cap;
 } abuf;
 
 typedef struct ecmd {
@@ -131,86 +515,211 @@ typedef struct ecmd {
     int argc;
 } ecmd;
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+//Every open buffer. The current one lives in editorInfo, so its slot is only up to date while another one is current.
+typedef struct ebuffers {
+    struct editorInfo *list;
+    int count;
+    int cap;
+    int current;
+} ebuffers;
+
+//What a window's text was last drawn from. The generation is bumped whenever something that shows in a buffer's text
+//changes, so if none of this has changed since the text doesn't need drawing again.
+typedef struct eviewkey {
+    int buffer;
+    unsigned int generation;
+    int yoffset, xoffset;
+    int w, h;
+    int cy, rx;
+} eviewkey;
+
+//A view onto a buffer. The current window's view lives in editorInfo, like the current buffer does.
+typedef struct ewindow {
+    int buffer;
+    int node;
+    int cx, cy, rx, tx;
+    int yoffset, xoffset;
+    int top, left, w, h;
+    abuf *rows;
+    int rowCount;
+    eviewkey drawn;
+} ewindow;
+
+//Windows are the leaves of a tree of splits, with the root at node 0. A split's second child is below or to the right.
+typedef struct esplit {
+    int window;
+    bool vertical;
+    int first;
+    int second;
+    int parent;
+} esplit;
+
+//With a single window none of this is used and the screen is drawn as it always was. rows holds what was last written
+//in each window row, so the compositor only writes the rows that changed unless full is set.
+typedef struct ewindows {
+    ewindow *list;
+    int count;
+    int current;
+    esplit *nodes;
+    int nodeCount;
+    int screenW;
+    int screenH;
+    bool full;
+} ewindows;
+
+//The rows last sent to a client when there's a single window, so a frame only carries the rows that changed. full is
+//set when the client's screen can't be trusted to hold them, like when it has just attached.
+typedef struct escreen {
+    abuf *rows;
+    int rowCount;
+    bool full;
+} escreen;
 
 struct editorInfo editorInfo;
+ebuffers buffers;
+ewindows windows;
+escreen screen;
+esavejob saveJob;
+etxn txn;
+eregister reg;
+int keyCount;
+int keyOp;
+emacro macros[26];
+int recording = -1;
+int lastMacro = -1;
+ereplay replay;
+estream stream = {.lock = PTHREAD_MUTEX_INITIALIZER};
+einput input;
+erender render = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+eserver server = {.listen = -1};
+volatile sig_atomic_t clientResized = 0;
+char clientNotice[128];
+efollow follow;
+eview view = {.lock = PTHREAD_MUTEX_INITIALIZER};
 bool firstMessage = true;
-
-char *cHLExtensions[] = {".c", ".h", NULL};
-char *cHLKeywords[] = {
-        "switch", "if", "while", "for", "break", "continue", "return", "else",
-        "struct", "union", "typedef", "static", "enum", "class", "case", "default",
-        "sizeof", "auto", "do", "volatile", "extern", "goto", "register", "NULL",
-        "inline",
-
-        "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-        "void|", "short|",
-
-        "#define]", "#endif]", "#error]", "#if]", "#ifdef]", "#ifndef]", "#include]", "#undef]", 
-        "#else]", "#elif]", "#pragma]", NULL
-};
-
-char *cppHLExtensions[] = {".cpp", ".h", ".hpp", ".cc", ".inl", NULL};
-char *cppHLKeywords[] = {
-        "switch", "if", "while", "for", "break", "continue", "return", "else",
-        "struct", "union", "typedef", "static", "enum", "class", "case", "default",
-        "sizeof", "auto", "do", "volatile", "extern", "goto", "register", "NULL",
-        "nullptr", "class", "public", "private", "protected", "template", "typename",
-        "true", "false", "friend", "this", "try", "catch", "trhow", "using", "namepsace"
-        "explicit", "virtual", "new", "delete", "mutable", "operator", "static_cast",
-        "dynamic_cast", "reinterpret_cast", "const_cast", "alignof", "inline"
-        "noexcept", 
-
-        "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-        "void|", "nullptr_t|", "size_t|", "bool|", "short|",
-
-        "#define]", "#endif]", "#error]", "#if]", "#ifdef]", "#ifndef]", "#include]", "#undef]", 
-        "#else]", "#elif]", "#pragma]", NULL
-};
-
-char *jsExtensions[] = {".js"};
-char *jsKeywords[] = {"abstract", "arguments", "await", "break",
-        "case", "catch", "class", "const", "continue", "debugger", "default",
-        "delete", "do", "else", "enum", "eval", "export", "extends", "false",
-        "final", "finally", "for", "function", "goto", "if", "implements", "import",
-        "in", "instanceof", "interface", "let", "native", "new", "null",
-        "package", "private", "protected", "public", "return", "static", "super",
-        "switch", "synchronized", "throw", "throws", "transient", "true", "try",
-        "typeof", "var", "void", "volatile", "while", "with", "yield", "get", "set",
-        "constructor",
-        
-        "boolean|", "byte|", "char|", "double|", "float|", "int|", "long|", "short|", 
-        
-        "this]", NULL
+bool needsRedraw = false;
+bool drawWindowed = false;
+
+//Built in language definitions, in the same format as the syntax/*.syn files.
+const char *builtinSyntax[] = {
+        "name c\n"
+        "match .c .h\n"
+        "comment //\n"
+        "block /* */\n"
+        "string \" \" escape \\\n"
+        "string ' ' escape \\\n"
+        "string < > after #include\n"
+        "numbers\n"
+        "keyword switch if while for break continue return else struct union typedef static enum class case\n"
+        "keyword default sizeof auto do volatile extern goto register NULL inline\n"
+        "type int long double float char unsigned signed void short\n"
+        "macro #define #endif #error #if #ifdef #ifndef #include #undef #else #elif #pragma\n",
+
+        "name c++\n"
+        "match .cpp .h .hpp .cc .inl\n"
+        "comment //\n"
+        "block /* */\n"
+        "string \" \" escape \\\n"
+        "string ' ' escape \\\n"
+        "string < > after #include\n"
+        "numbers\n"
+        "keyword switch if while for break continue return else struct union typedef static enum class case\n"
+        "keyword default sizeof auto do volatile extern goto register NULL nullptr public private protected\n"
+        "keyword template typename true false friend this try catch throw using namespace explicit virtual new\n"
+        "keyword delete mutable operator static_cast dynamic_cast reinterpret_cast const_cast alignof inline\n"
+        "keyword noexcept\n"
+        "type int long double float char unsigned signed void nullptr_t size_t bool short\n"
+        "macro #define #endif #error #if #ifdef #ifndef #include #undef #else #elif #pragma\n",
+
+        "name js\n"
+        "match .js\n"
+        "comment //\n"
+        "block /* */\n"
+        "string \" \" escape \\\n"
+        "string ' ' escape \\\n"
+        "string ` ` escape \\ interp ${ }\n"
+        "numbers\n"
+        "keyword abstract arguments await break case catch class const continue debugger default delete do\n"
+        "keyword else enum eval export extends false final finally for function goto if implements import in\n"
+        "keyword instanceof interface let native new null package private protected public return static super\n"
+        "keyword switch synchronized throw throws transient true try typeof var void volatile while with yield\n"
+        "keyword get set constructor\n"
+        "type boolean byte char double float int long short\n"
+        "macro this\n",
+        NULL
 };
 
-editorSyntax HLDB[] = {
-        {"c", cHLExtensions, cHLKeywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-        {"c++", cppHLExtensions, cppHLKeywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-        {"js", jsExtensions, jsKeywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS}
-};
-
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+editorSyntax *syntaxes = NULL;
+int syntaxCount = -1;
 
 void ecls();
 int eReadKey();
 char *ePrompt(const char *prompt, void (*callback)(char *, int));
 void eSelectSyntaxHL();
+unsigned long long eHashLine(const char *data, int size);
+unsigned long long eHashData(const char *data, long long size);
 void eInsertChar();
 void eInsertTab();
 void eSetStatus(const char *fmt, ...);
 void eSetError(const char *fmt, ...);
+void eInit();
 void eReset();
+void eSaveIdle();
+void eSaveWait();
+void eLineTouch(eline *line);
+bool eCompressIdle(long long deadline);
+bool eHighlightIdle(long long deadline);
+char *eLineDataTemp(eline *line);
+void eLineReady(eline *line);
+void eHighlightParallel();
+int eLoadThreads(long long work, long long minChunk);
+void eLoadRun(void *(*fn)(void *), void *chunks, size_t size, int n);
+bool eStreamIdle(long long deadline);
+void eStreamClose();
+bool eFollowStart();
+void eFollowStop();
+void eFollowIdle();
+void eDiskIdle();
+void eIndexIdle();
+void eViewIdle();
+void eViewClose();
+void eGotoEnd();
+void eUndoRecord(char type, int line, int col, const char *text, int len);
+void eLineDeleteRange(eline *line, int idx, int len);
+void eTickKey(int k);
+int eCursorCmp(const void *a, const void *b);
+int eCursorFirst(int cy);
+void eCursorSort();
+void die(const char *s);
+void eRenderFlush();
+void eWindowCompose(abuf *ab);
+void resizeWindow();
+void eServerAccept();
+void eServerDetach();
+void eServerTakeover();
+bool eWritev(int fd, struct iovec *iov, int iovcnt);
 
 void abAppend(abuf *ab, const char *s, int len) {
-    char *n = (char*)realloc(ab->b, ab->len + len);
-
-    if (n == NULL) {
+    if (len <= 0) {
         return;
     }
 
-    memcpy(&n[ab->len], s, len);
-    ab->b = n;
+    //Grows by doubling, so building something up a piece at a time stays linear.
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap * 2 > ab->len + len ? ab->cap * 2 : ab->len + len;
+        char *n = (char*)realloc(ab->b, cap);
+
+        if (n == NULL) {
+            return;
+        }
+
+        ab->b = n;
+        ab->cap = cap;
+    }
+
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
@@ -218,7 +727,7 @@ void abFree(abuf *ab) {
     free(ab->b);
 }
 
-int getNumDigits(int n) {
+int getNumDigits(long long n) {
     int numDigits = 0;
 
     while (n != 0) {
@@ -261,6 +770,7 @@ ecmd parseCMD(char *cmdStr) {
 }
 
 int eCxToRx(eline *line, int cx) {
+    eLineTouch(line);
     int rx = 0;
     for (int i = 0; i < cx; ++i) {
         if (line->data[i] == '\t') {
@@ -274,6 +784,7 @@ int eCxToRx(eline *line, int cx) {
 }
 
 int eRxToCx(eline *line, int rx) {
+    eLineTouch(line);
     int currentRx = 0;
     int cx;
     for ( cx = 0; cx < line->size; ++cx) {
@@ -307,826 +818,4987 @@ void eSetFilenameTrunc() {
     }
 }
 
-void eUpdateSyntax(eline *line) {
-    line->hl = (unsigned char*)realloc(line->hl, line->rsize);
-    memset(line->hl, HLNormal, line->rsize);
-    bool inJs = false;
+unsigned short *eLexNext(const elexer *lex) {
+    return (unsigned short*)(lex + 1);
+}
 
-    if (editorInfo.syntax == NULL) {
-        return;
-    }
-    
-    if (strcmp(editorInfo.syntax->filetype, "js") == 0) {
-        inJs = true;
-    }
+unsigned char *eLexKind(const elexer *lex) {
+    return (unsigned char*)(eLexNext(lex) + lex->states * lex->classes);
+}
 
-    char **keywords = editorInfo.syntax->keywords;
+unsigned char *eLexArg(const elexer *lex) {
+    return eLexKind(lex) + lex->states;
+}
 
-    char *scs = editorInfo.syntax->singleLineCommentStart;
-    char *mcs = editorInfo.syntax->multilineCommentStart;
-    char *mce = editorInfo.syntax->multilineCommentEnd;
+//The token trie a definition gets built into before it's squeezed into classes.
+typedef struct elexbuild {
+    int (*next)[256];
+    unsigned char *kind;
+    unsigned char *arg;
+    int states;
+    int cap;
+} elexbuild;
+
+int eLexAddToken(elexbuild *b, const char *tok, int kind, int arg) {
+    int st = 1;
+    for (const unsigned char *p = (const unsigned char*)tok; *p; ++p) {
+        if (b->next[st][*p] == 0) {
+            if (b->states == b->cap) {
+                b->cap *= 2;
+                b->next = realloc(b->next, sizeof(*b->next) * b->cap);
+                b->kind = (unsigned char*)realloc(b->kind, b->cap);
+                b->arg = (unsigned char*)realloc(b->arg, b->cap);
+            }
 
-    int scsLen = scs ? (int)strlen(scs) : 0;
-    int mcsLen = mcs ? (int)strlen(mcs) : 0;
-    int mceLen = mce ? (int)strlen(mce) : 0;
+            memset(b->next[b->states], 0, sizeof(*b->next));
+            b->kind[b->states] = LexNone;
+            b->arg[b->states] = 0;
+            b->next[st][*p] = b->states++;
+        }
+        st = b->next[st][*p];
+    }
 
-    bool prevSep = true;
-    int inString = false;
-    int inInclude = false;
-    int inComment = (line->idx > 0 && editorInfo.line[line->idx - 1].hlOpenComment);
-    bool inJsString = false;
+    b->kind[st] = (unsigned char)kind;
+    b->arg[st] = (unsigned char)arg;
+    return st;
+}
 
-    int i = 0;
-    while (i < line->rsize) {
-        char c = line->rdata[i];
-        unsigned char prevHL = (i > 0) ? line->hl[i - 1] : HLNormal;
+//Copies a delimiter into a fixed size field. Returns false if it's empty or doesn't fit.
+bool eLexDelim(char *out, const char *tok) {
+    if (tok == NULL || strlen(tok) == 0 || strlen(tok) >= LEX_DELIM) {
+        return false;
+    }
 
-        if (scsLen && !inString && !inComment) {
-            if (!strncmp(&line->rdata[i], scs, scsLen)) {
-                memset(&line->hl[i], HLComment, line->rsize - i);
-                break;
-            }
+    strcpy(out, tok);
+    return true;
+}
+
+//Compiles a language definition into a lexer. Returns NULL if the definition is broken.
+elexer *eLexCompile(const char *def, unsigned long long hash) {
+    elexer head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, "SHLX", 4);
+    head.version = LEX_VERSION;
+    head.hash = hash;
+
+    elexbuild b;
+    b.cap = 256;
+    b.states = 2;
+    b.next = calloc(b.cap, sizeof(*b.next));
+    b.kind = (unsigned char*)calloc(b.cap, 1);
+    b.arg = (unsigned char*)calloc(b.cap, 1);
+
+    char after[LEX_MAX_STRINGS][64];
+    memset(after, 0, sizeof(after));
+
+    char *text = strdup(def);
+    char *lineSave = NULL;
+    bool ok = true;
+    for (char *l = strtok_r(text, "\n", &lineSave); l && ok; l = strtok_r(NULL, "\n", &lineSave)) {
+        char *save = NULL;
+        char *cmd = strtok_r(l, " \t\r", &save);
+        if (cmd == NULL || cmd[0] == '#') {
+            continue;
         }
 
-        if (mcsLen && mceLen && !inString) {
-            if (inComment) {
-                line->hl[i] = HLMLComment;
-                if (!strncmp(&line->rdata[i], mce, mceLen)) {
-                    memset(&line->hl[i], HLMLComment, mceLen);
-                    i += mceLen;
-                    inComment = 0;
-                    prevSep = 1;
-                    continue;
+        int kind = LexNone;
+        if (strcmp(cmd, "keyword") == 0) {
+            kind = LexKeyword;
+        } else if (strcmp(cmd, "type") == 0) {
+            kind = LexType;
+        } else if (strcmp(cmd, "macro") == 0) {
+            kind = LexMacro;
+        } else if (strcmp(cmd, "comment") == 0) {
+            char *tok = strtok_r(NULL, " \t\r", &save);
+            ok = tok != NULL;
+            if (ok) {
+                eLexAddToken(&b, tok, LexComment, 0);
+            }
+        } else if (strcmp(cmd, "block") == 0) {
+            char *open = strtok_r(NULL, " \t\r", &save);
+            ok = open != NULL && eLexDelim(head.blockEnd, strtok_r(NULL, " \t\r", &save));
+            if (ok) {
+                eLexAddToken(&b, open, LexBlock, 0);
+            }
+        } else if (strcmp(cmd, "string") == 0) {
+            ok = head.stringCount < LEX_MAX_STRINGS;
+            elexstring *str = &head.strings[ok ? head.stringCount : 0];
+            ok = ok && eLexDelim(str->open, strtok_r(NULL, " \t\r", &save));
+            ok = ok && eLexDelim(str->close, strtok_r(NULL, " \t\r", &save));
+            for (char *opt = strtok_r(NULL, " \t\r", &save); ok && opt; opt = strtok_r(NULL, " \t\r", &save)) {
+                char *val = strcmp(opt, "multiline") == 0 ? NULL : strtok_r(NULL, " \t\r", &save);
+                if (strcmp(opt, "multiline") == 0) {
+                    str->multiline = true;
+                } else if (strcmp(opt, "escape") == 0 && val && strlen(val) == 1) {
+                    str->escape = val[0];
+                } else if (strcmp(opt, "after") == 0 && val && strlen(val) < sizeof(after[0])) {
+                    strcpy(after[head.stringCount], val);
+                } else if (strcmp(opt, "interp") == 0 && val) {
+                    ok = eLexDelim(str->interpOpen, val) && eLexDelim(str->interpClose, strtok_r(NULL, " \t\r", &save));
                 } else {
-                    ++i;
-                    continue;
+                    ok = false;
                 }
-            } else if (!strncmp(&line->rdata[i], mcs, mcsLen)) {
-                memset(&line->hl[i], HLMLComment, mcsLen);
-                i += mcsLen;
-                inComment = 1;
-                continue;
             }
+
+            if (ok) {
+                eLexAddToken(&b, str->open, LexString, head.stringCount++);
+            }
+        } else if (strcmp(cmd, "numbers") == 0) {
+            head.numbers = true;
         }
 
-        if (editorInfo.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (inString) {
-                line->hl[i] = HLString;
-                if (c == '\\' && i + 1 < line->rsize) {
-                    line->hl[i + 1] = HLString;
-                    i += 2;
-                    continue;
-                }
-                
-                if (inJsString && c == '$') {
-                    line->hl[i] = HLDollar;
-                }
-                
-                //TODO(Skyler): Make not stupid.
-                if (inJsString && c == '{' && line->rdata[i - 1] == '$') {
-                    while (i < line->rsize && c != '}') {
-                        line->hl[i] = HLNormal;
-                        ++i;
-                        c = line->rdata[i];
-                    }
-                    
-                }
+        for (char *tok = kind ? strtok_r(NULL, " \t\r", &save) : NULL; tok; tok = strtok_r(NULL, " \t\r", &save)) {
+            eLexAddToken(&b, tok, kind, 0);
+        }
+    }
+    free(text);
 
-                if (c == inString) {
-                    inString = false;
-                    inJsString = false;
-                }
+    //Strings that only start after a given word remember that word's state, since that's what the lexer sees.
+    for (int i = 0; ok && i < head.stringCount; ++i) {
+        int st = 1;
+        for (const unsigned char *p = (const unsigned char*)after[i]; *p && st; ++p) {
+            st = b.next[st][*p];
+        }
+        head.strings[i].after = after[i][0] && st > 1 ? st : 0;
+        ok = after[i][0] == '\0' || head.strings[i].after != 0;
+    }
 
-                ++i;
-                prevSep = true;
-                continue;
-            } else {
-                inJsString = (inJs && c == '`');
-                if (c == '"' || c == '\'' || inJsString) {
-                    inString = (int)c;
-                    line->hl[i] = HLString;
-                    ++i;
-                    continue;
-                }
+    elexer *lex = NULL;
+    if (ok && b.states <= LEX_MAX_STATES) {
+        //Every byte some token uses gets a class of its own, the rest share class 0.
+        head.classes = 1;
+        for (int c = 0; c < 256; ++c) {
+            bool used = false;
+            for (int st = 1; st < b.states && !used; ++st) {
+                used = b.next[st][c] != 0;
             }
+            head.cls[c] = used ? head.classes++ : 0;
+        }
 
-            if (strcmp(editorInfo.syntax->filetype, "c") == 0 || strcmp(editorInfo.syntax->filetype, "cpp") == 0) {
-                if (strstr(line->data, "<") && strstr(line->data, "#include")) {
-                    if (inInclude) {
-                        line->hl[i] = HLString;
-
-                        if (c == '>') {
-                            inInclude = false;
-                        }
+        head.states = b.states;
+        head.size = (int)(sizeof(elexer) + sizeof(unsigned short) * head.states * head.classes + head.states * 2);
+        lex = (elexer*)calloc(1, head.size);
+        memcpy(lex, &head, sizeof(elexer));
 
-                        ++i;
-                        prevSep = true;
-                        continue;
-                    } else {
-                        if (c == '<') {
-                            inInclude = true;
-                            line->hl[i] = HLString;
-                            ++i;
-                            continue;
-                        }
-                    }
+        unsigned short *next = eLexNext(lex);
+        for (int st = 0; st < b.states; ++st) {
+            for (int c = 0; c < 256; ++c) {
+                if (head.cls[c]) {
+                    next[st * head.classes + head.cls[c]] = (unsigned short)b.next[st][c];
                 }
             }
         }
+        memcpy(eLexKind(lex), b.kind, b.states);
+        memcpy(eLexArg(lex), b.arg, b.states);
+    }
 
-        if (editorInfo.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            bool isNumber = false;
-            if (((isdigit(c) && ((prevSep || prevHL == HLNumber))) || (c == '.' && prevHL == HLNumber))) {
-                isNumber = true;
-            }
+    free(b.next);
+    free(b.kind);
+    free(b.arg);
+    return lex;
+}
 
-            if ((isxdigit(c) && (prevHL == HLNumber)) || ((c == 'x' || c == 'X') && prevHL == HLNumber)) {
-                isNumber = true;
-            }
+//Where compiled lexers get cached, created if needed. Returns NULL if there's no home to put it in.
+char *eCacheDir() {
+    char *base = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char path[PATH_MAX];
+    if (base && base[0]) {
+        snprintf(path, sizeof(path), "%s", base);
+    } else if (home && home[0]) {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
 
-            if (isNumber) {
-                line->hl[i] = HLNumber;
-                ++i;
-                prevSep = false;
-                continue;
-            }
-        }
+    mkdir(path, 0700);
+    strncat(path, "/shabi", sizeof(path) - strlen(path) - 1);
+    mkdir(path, 0700);
+    return strdup(path);
+}
 
-        if (prevSep) {
-            int j;
-            for (j = 0; keywords[j]; ++j) {
-                int klen = (int)strlen(keywords[j]);
-                bool isType = keywords[j][klen - 1] == '|';
-                bool isMacro = keywords[j][klen - 1] == ']';
-                if (isType || isMacro) {
-                    --klen;
-                }
+//Reads a whole cache file into a fresh allocation, or returns NULL if it can't or it's smaller than min. Checking what's
+//in it is up to the caller.
+void *eCacheRead(const char *path, long long min, long long *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1) {
+        return NULL;
+    } else if (fstat(fd, &st) == -1 || st.st_size < (off_t)min) {
+        close(fd);
+        return NULL;
+    }
 
-                if (!strncmp(&line->rdata[i], keywords[j], klen) && isSeperator(line->rdata[i + klen])) {
-                    int hlKind = HLKeywords;
-                    if (isType) {
-                        hlKind = HLType;
-                    } else if (isMacro) {
-                        hlKind = HLMacro;
-                    }
+    void *data = malloc(st.st_size);
+    bool ok = data != NULL && read(fd, data, st.st_size) == st.st_size;
+    close(fd);
 
-                    memset(&line->hl[i], hlKind, klen);
-                    i += klen;
-                    break;
-                }
-            }
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
 
-            if (keywords[j] != NULL) {
-                prevSep = false;
-                continue;
-            }
-        }
+//Writes a cache file to the side first and then renames it into place, so another instance never reads half of one.
+void eCacheWrite(const char *path, struct iovec *iov, int iovcnt) {
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
 
-        prevSep = isSeperator(c);
-        ++i;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return;
     }
 
-    int changed = (line->hlOpenComment != inComment);
-    line->hlOpenComment = inComment;
-    if (changed && line->idx + 1 < editorInfo.linecount) {
-        eUpdateSyntax(&editorInfo.line[line->idx + 1]);
+    bool ok = eWritev(fd, iov, iovcnt);
+    close(fd);
+    if (!ok || rename(tmp, path) == -1) {
+        unlink(tmp);
     }
 }
 
-int syntaxToColor(int hl) {
-    switch (hl) {
-        case HLComment:
-        case HLMLComment: return 28;
-        case HLKeywords: return 124;
-        case HLType: return 166;
-        case HLMacro: return 29;
-        case HLString: return 34;
-        case HLNumber: return 90;
-        case HLMatch: return 198;
-        case HLDollar: return 208;
-        default: return 37;
-    }
+bool eLexDelimValid(const char *d) {
+    return memchr(d, '\0', LEX_DELIM) != NULL;
 }
 
-void eSelectSyntaxHL() {
-    editorInfo.syntax = NULL;
-    if (editorInfo.filename == NULL) {
-        return;
+//The size and hash only say the table is the one that was written, not that it's intact. Everything eLexLine indexes
+//with has to stay in range, or a damaged cache file would take the editor down with it.
+bool eLexValid(const elexer *lex) {
+    for (int c = 0; c < 256; ++c) {
+        if (lex->cls[c] >= lex->classes) {
+            return false;
+        }
     }
 
-    char *ext = strrchr(editorInfo.filename, '.');
+    const unsigned short *next = eLexNext(lex);
+    for (long long i = 0; i < (long long)lex->states * lex->classes; ++i) {
+        if (next[i] >= lex->states) {
+            return false;
+        }
+    }
 
-    for (unsigned int i = 0; i < HLDB_ENTRIES; ++i) {
-        editorSyntax *s = &HLDB[i];
-        unsigned int idx = 0;
-        while (s->filematch[idx]) {
-            bool isExt = (s->filematch[idx][0] == '.');
+    const unsigned char *kind = eLexKind(lex);
+    const unsigned char *arg = eLexArg(lex);
+    for (int st = 0; st < lex->states; ++st) {
+        if (kind[st] > LexString || (kind[st] == LexString && arg[st] >= lex->stringCount)) {
+            return false;
+        }
+    }
 
-            if ((isExt && ext && !strcmp(ext, s->filematch[idx])) || (!isExt && strstr(editorInfo.filename, s->filematch[idx]))) {
-                eSetStatus(ext);
-                if (strcmp(s->filetype, ".h") == 0) {
-                    //Check if a cpp file exists with the same name and if it does set that as the syntax.
-                }
-                
-                editorInfo.syntax = s;
+    if (!eLexDelimValid(lex->blockEnd)) {
+        return false;
+    }
+    for (int i = 0; i < lex->stringCount; ++i) {
+        const elexstring *str = &lex->strings[i];
+        if (!eLexDelimValid(str->open) || !eLexDelimValid(str->close) || !eLexDelimValid(str->interpOpen) ||
+            !eLexDelimValid(str->interpClose)) {
+            return false;
+        }
+    }
 
-                for (int fileline = 0; fileline < editorInfo.linecount; ++fileline) {
-                    eUpdateSyntax(&editorInfo.line[fileline]);
-                }
+    return true;
+}
 
-                return;
-            }
+elexer *eLexLoadCache(unsigned long long hash) {
+    char *dir = eCacheDir();
+    if (dir == NULL) {
+        return NULL;
+    }
 
-            ++idx;
-        }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.lex", dir, hash);
+    free(dir);
+
+    long long size;
+    elexer *lex = (elexer*)eCacheRead(path, sizeof(elexer), &size);
+    if (lex == NULL) {
+        return NULL;
     }
-}
 
-void eMoveToEndOfLine(int idx) {
-    editorInfo.cy = idx;
-    eline *line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
-    int linelen = line ? line->size : 0;
-    editorInfo.cx = linelen;
-    editorInfo.tx = editorInfo.cx;
-}
+    bool ok = memcmp(lex->magic, "SHLX", 4) == 0 &&
+              lex->version == LEX_VERSION && lex->hash == hash && lex->size == size &&
+              lex->states > 1 && lex->classes > 0 && lex->stringCount >= 0 && lex->stringCount <= LEX_MAX_STRINGS &&
+              (long long)sizeof(elexer) + (long long)lex->states * lex->classes * 2 + lex->states * 2 == lex->size &&
+              eLexValid(lex);
 
-void eMoveToBeginningOfLine(int idx) {
-    editorInfo.cy = idx;
-    editorInfo.cx = 0;
-    editorInfo.tx = editorInfo.cx;
+    if (!ok) {
+        free(lex);
+        return NULL;
+    }
+    return lex;
 }
 
-void eUpdateLine(eline *line) {
-    int tabs = 0;
-    for (int i = 0; i < line->size; ++i) {
-        if (line->data[i] == '\t') {
-            ++tabs;
-        }
+void eLexSaveCache(elexer *lex) {
+    char *dir = eCacheDir();
+    if (dir == NULL) {
+        return;
     }
 
-    free(line->rdata);
-    line->rdata  = (char*)malloc(line->size + tabs * (TAB_SIZE - 1) + 4);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.lex", dir, lex->hash);
+    free(dir);
 
-    int idx = 0;
-    for (int j = 0; j < line->size; ++j) {
-        if (line->data[j] == '\t') {
-            line->rdata[idx++] = ' ';
-            while (idx % TAB_SIZE != 0) {
-                line->rdata[idx++] = ' ';
-            }
+    struct iovec iov = {lex, lex->size};
+    eCacheWrite(path, &iov, 1);
+}
 
-            /* Adds ┊ but messes up cursor movement.
-            line->rdata[idx++] = '\xE2';
-            line->rdata[idx++] = '\x94';
-            line->rdata[idx++] = '\x8A';
-            */
-        } else {
-            line->rdata[idx++] = line->data[j];
+//Reads the name and file matches from a definition. Returns false if it has no name.
+bool eSyntaxAdd(char *def) {
+    editorSyntax s = {NULL, NULL, def, 0, NULL};
+    int matches = 0;
+    s.filematch = (char**)malloc(sizeof(char*));
+
+    char *text = strdup(def);
+    char *lineSave = NULL;
+    for (char *l = strtok_r(text, "\n", &lineSave); l; l = strtok_r(NULL, "\n", &lineSave)) {
+        char *save = NULL;
+        char *cmd = strtok_r(l, " \t\r", &save);
+        if (cmd && strcmp(cmd, "name") == 0 && s.filetype == NULL) {
+            char *name = strtok_r(NULL, " \t\r", &save);
+            s.filetype = name ? strdup(name) : NULL;
+        } else if (cmd && strcmp(cmd, "match") == 0) {
+            for (char *m = strtok_r(NULL, " \t\r", &save); m; m = strtok_r(NULL, " \t\r", &save)) {
+                s.filematch = (char**)realloc(s.filematch, sizeof(char*) * (matches + 2));
+                s.filematch[matches++] = strdup(m);
+            }
         }
     }
+    free(text);
+    s.filematch[matches] = NULL;
 
-    line->rdata[idx] = '\0';
-    line->rsize = idx;
+    if (s.filetype == NULL) {
+        for (int i = 0; i < matches; ++i) {
+            free(s.filematch[i]);
+        }
+        free(s.filematch);
+        return false;
+    }
 
-    eUpdateSyntax(line);
+    s.hash = eHashLine(def, (int)strlen(def)) ^ LEX_VERSION;
+    syntaxes = (editorSyntax*)realloc(syntaxes, sizeof(editorSyntax) * (syntaxCount + 1));
+    syntaxes[syntaxCount++] = s;
+    return true;
 }
 
-void eInsertLine(int idx, char *line, size_t len) {
-    if (idx < 0 || idx > editorInfo.linecount) {
+//Adds every *.syn definition in a directory.
+void eSyntaxAddDir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
         return;
     }
 
-    editorInfo.line = (eline*)realloc(editorInfo.line, sizeof(eline) * (editorInfo.linecount + 1));
-    memmove(&editorInfo.line[idx + 1], &editorInfo.line[idx], sizeof(eline) * (editorInfo.linecount - idx));
-    for (int i = idx + 1; i <= editorInfo.linecount; ++i) {
-        ++editorInfo.line[i].idx;
-    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int len = (int)strlen(e->d_name);
+        if (len < 5 || strcmp(&e->d_name[len - 4], ".syn") != 0) {
+            continue;
+        }
 
-    editorInfo.line[idx].idx = idx;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
 
-    editorInfo.line[idx].size = len;
-    editorInfo.line[idx].data = (char*)malloc(len + 1);
-    memcpy(editorInfo.line[idx].data, line, len);
-    editorInfo.line[idx].data[len] = '\0';
+        char *def = NULL;
+        size_t cap = 0;
+        ssize_t n = getdelim(&def, &cap, '\0', fp);
+        fclose(fp);
+        if (n <= 0 || !eSyntaxAdd(def)) {
+            free(def);
+        }
+    }
+    closedir(d);
+}
 
-    editorInfo.line[idx].rsize = 0;
-    editorInfo.line[idx].rdata = NULL;
-    editorInfo.line[idx].hl = NULL;
-    editorInfo.line[idx].hlOpenComment = 0;
-    eUpdateLine(&editorInfo.line[idx]);
+//Finds the definitions once. The user's own come first so they can override the ones shipped with shabi, and the
+//built in ones come last.
+void eSyntaxLoadAll() {
+    if (syntaxCount >= 0) {
+        return;
+    }
+    syntaxCount = 0;
+
+    char path[PATH_MAX];
+    char *config = getenv("XDG_CONFIG_HOME");
+    char *home = getenv("HOME");
+    if (config && config[0]) {
+        snprintf(path, sizeof(path), "%s/shabi/syntax", config);
+        eSyntaxAddDir(path);
+    } else if (home && home[0]) {
+        snprintf(path, sizeof(path), "%s/.config/shabi/syntax", home);
+        eSyntaxAddDir(path);
+    }
 
-    ++editorInfo.linecount;
-    ++editorInfo.dirty;
+    //Next to the binary, or next to the build directory it lives in.
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 16);
+    path[len > 0 ? len : 0] = '\0';
+    char *slash = strrchr(path, '/');
+    if (slash) {
+        *slash = '\0';
+        len = slash - path;
+        strcpy(&path[len], "/syntax");
+        eSyntaxAddDir(path);
+        strcpy(&path[len], "/../syntax");
+        eSyntaxAddDir(path);
+    }
 
-    editorInfo.maxLineLen = getNumDigits(editorInfo.linecount);
+    for (int i = 0; builtinSyntax[i]; ++i) {
+        eSyntaxAdd(strdup(builtinSyntax[i]));
+    }
 }
 
-void eInsertNewLine() {
-    if (editorInfo.cx == 0) {
-        eInsertLine(editorInfo.cy, NULL, 0);
-    } else {
-        eline *line = &editorInfo.line[editorInfo.cy];
-        eInsertLine(editorInfo.cy + 1, &line->data[editorInfo.cx], line->size - editorInfo.cx);
-        line = &editorInfo.line[editorInfo.cy];
-        line->size = editorInfo.cx;
-        line->data[line->size] = '\0';
-        eUpdateLine(line);
+//Gets a language's lexer ready, from memory, the cache, or by compiling its definition.
+elexer *eSyntaxLexer(editorSyntax *s) {
+    if (s->lex == NULL) {
+        s->lex = eLexLoadCache(s->hash);
     }
-
-    ++editorInfo.cy;
-    editorInfo.cx = 0;
-
-    int spaces = 0;
-    int tabs = 0;
-    char *str = editorInfo.line[editorInfo.cy - 1].data;
-    for (int i = 0; i < editorInfo.line[editorInfo.cy - 1].size; ++i) {
-        if (str[i] == ' ') {
-            ++spaces;
-        } else if (str[i] == '\t') {
-            ++tabs;
-        } else {
-            break;
+    if (s->lex == NULL) {
+        s->lex = eLexCompile(s->def, s->hash);
+        if (s->lex == NULL) {
+            eSetError("Bad syntax definition for '%s'", s->filetype);
+            return NULL;
         }
+        eLexSaveCache(s->lex);
     }
 
-    int oldcx = editorInfo.cx;
-    editorInfo.cx = 0;
+    return s->lex;
+}
 
-    int indent = 0;
-    if (spaces % TAB_SIZE == 0) {
-        indent += spaces / TAB_SIZE;
-    } else {
-        for (int i = 0; i < spaces; ++i) {
-            eInsertChar(' ');
+//Lexes one line given the state the previous one left, and returns the state it leaves. Languages only differ in
+//their tables, so nothing here knows about any one of them.
+int eLexLine(const elexer *lex, const char *r, int n, unsigned char *hl, int state) {
+    const unsigned short *next = eLexNext(lex);
+    const unsigned char *kind = eLexKind(lex);
+    const unsigned char *arg = eLexArg(lex);
+    int blockLen = (int)strlen(lex->blockEnd);
+    bool prevSep = true;
+    int lastWord = 0;
+
+    int i = 0;
+    while (i < n) {
+        if (state == LexInBlock) {
+            if (blockLen && strncmp(&r[i], lex->blockEnd, blockLen) == 0) {
+                memset(&hl[i], HLMLComment, blockLen);
+                i += blockLen;
+                state = LexInCode;
+                prevSep = true;
+            } else {
+                hl[i++] = HLMLComment;
+            }
+            continue;
+        } else if (state >= LexInString) {
+            const elexstring *str = &lex->strings[state - LexInString];
+            int closeLen = (int)strlen(str->close);
+            int interpLen = (int)strlen(str->interpOpen);
+            hl[i] = HLString;
+            if (str->escape && r[i] == str->escape && i + 1 < n) {
+                hl[i + 1] = HLString;
+                i += 2;
+            } else if (interpLen && strncmp(&r[i], str->interpOpen, interpLen) == 0) {
+                //The code inside is left plain, with the opening marked.
+                hl[i] = HLDollar;
+                i += interpLen;
+                int endLen = (int)strlen(str->interpClose);
+                while (i < n && strncmp(&r[i], str->interpClose, endLen) != 0) {
+                    ++i;
+                }
+                i += i < n ? endLen : 0;
+            } else if (strncmp(&r[i], str->close, closeLen) == 0) {
+                memset(&hl[i], HLString, closeLen);
+                i += closeLen;
+                state = LexInCode;
+            } else {
+                ++i;
+            }
+            prevSep = true;
+            continue;
+        }
+
+        //Take the longest token that can start here.
+        int st = 1, acc = 0, accLen = 0;
+        for (int j = i; j < n && (st = next[st * lex->classes + lex->cls[(unsigned char)r[j]]]) != 0; ++j) {
+            int k = kind[st];
+            if (k == LexNone) {
+                continue;
+            } else if (k <= LexMacro && (!prevSep || !isSeperator(j + 1 < n ? r[j + 1] : '\0'))) {
+                continue;
+            } else if (k == LexString && lex->strings[arg[st]].after && lex->strings[arg[st]].after != lastWord) {
+                continue;
+            }
+
+            acc = st;
+            accLen = j - i + 1;
+        }
+
+        if (acc) {
+            int k = kind[acc];
+            if (k == LexComment) {
+                memset(&hl[i], HLComment, n - i);
+                break;
+            } else if (k == LexBlock) {
+                memset(&hl[i], HLMLComment, accLen);
+                state = LexInBlock;
+            } else if (k == LexString) {
+                memset(&hl[i], HLString, accLen);
+                state = LexInString + arg[acc];
+            } else {
+                memset(&hl[i], k == LexKeyword ? HLKeywords : k == LexType ? HLType : HLMacro, accLen);
+                lastWord = acc;
+                prevSep = false;
+            }
+
+            i += accLen;
+            continue;
+        }
+
+        if (lex->numbers) {
+            char c = r[i];
+            unsigned char prevHL = i > 0 ? hl[i - 1] : HLNormal;
+            if ((isdigit(c) && (prevSep || prevHL == HLNumber)) || (prevHL == HLNumber && (c == '.' || isxdigit(c) || c == 'x' || c == 'X'))) {
+                hl[i++] = HLNumber;
+                prevSep = false;
+                continue;
+            }
         }
+
+        prevSep = isSeperator(r[i]);
+        ++i;
     }
-    indent += tabs;
 
-    for (int i = 0; i < indent; ++i) {
-        eInsertTab();
+    //Only multiline strings carry on to the next line.
+    if (state >= LexInString && !lex->strings[state - LexInString].multiline) {
+        state = LexInCode;
     }
-    editorInfo.cx = oldcx + spaces + tabs;
+
+    return state;
 }
 
-void eFreeLine(eline *line) {
-    free(line->rdata);
-    free(line->data);
-    free(line->hl);
+bool eIsOpenBracket(char c) {
+    return c == '(' || c == '[' || c == '{';
 }
 
-void eDeleteLine(int idx) {
-    if (idx < 0 || idx >= editorInfo.linecount) {
-        return;
-    }
+bool eIsCloseBracket(char c) {
+    return c == ')' || c == ']' || c == '}';
+}
 
-    eFreeLine(&editorInfo.line[idx]);
-    memmove(&editorInfo.line[idx], &editorInfo.line[idx + 1], sizeof(eline) * (editorInfo.linecount - idx - 1));
-    for (int i = 0; i < editorInfo.linecount - 1; ++i) {
-        --editorInfo.line[i].idx;
-    }
-    --editorInfo.linecount;
-    ++editorInfo.dirty;
+//Brackets in strings and comments don't count. hl can be NULL when there's no syntax.
+bool eIsCodeBracket(const char *r, const unsigned char *hl, int i) {
+    return (eIsOpenBracket(r[i]) || eIsCloseBracket(r[i])) && (hl == NULL || hl[i] == HLNormal || hl[i] == HLMatch);
 }
 
-void eLineInsertChar(eline *line, int idx, int c) {
-    if (idx < 0 || idx > line->size) {
-        idx = line->size;
+//a followed by b.
+ebracket eBracketJoin(ebracket a, ebracket b) {
+    int m = a.open < b.close ? a.open : b.close;
+    return (ebracket){a.open + b.open - m, a.close + b.close - m};
+}
+
+ebracket eBracketScan(const char *r, int n, const unsigned char *hl) {
+    ebracket br = {0, 0};
+    for (int i = 0; i < n; ++i) {
+        if (!eIsCodeBracket(r, hl, i)) {
+            continue;
+        } else if (eIsOpenBracket(r[i])) {
+            ++br.open;
+        } else if (br.open > 0) {
+            --br.open;
+        } else {
+            ++br.close;
+        }
     }
 
-    line->data = (char*)realloc(line->data, line->size + 2);
-    memmove(&line->data[idx + 1], &line->data[idx], line->size - idx + 1);
-    ++line->size;
-    line->data[idx] = (char)c;
-    eUpdateLine(line);
-    ++editorInfo.dirty;
+    return br;
 }
 
-void eLineDeleteChar(eline *line, int idx) {
-    if (idx < 0 || idx >= line->size) {
-        return;
+//Block holding line idx, with its first line in start. Lookups mostly come in order, so they walk from the last one.
+int eBracketBlock(int idx, int *start) {
+    ebrblock *blk = editorInfo.brBlocks;
+    int b = editorInfo.brHint, s = editorInfo.brHintStart;
+    if (b >= editorInfo.brBlockCount) {
+        b = 0;
+        s = 0;
+    }
+    while (b > 0 && idx < s) {
+        --b;
+        s -= blk[b].count;
+    }
+    while (b + 1 < editorInfo.brBlockCount && idx >= s + blk[b].count) {
+        s += blk[b].count;
+        ++b;
     }
 
-    memmove(&line->data[idx], &line->data[idx + 1], line->size - idx);
-    --line->size;
-    eUpdateLine(line);
-    ++editorInfo.dirty;
+    editorInfo.brHint = b;
+    editorInfo.brHintStart = s;
+    *start = s;
+    return b;
 }
 
-void eLineAppendString(eline *line, char *s, size_t len) {
-    line->data = (char*)realloc(line->data, line->size + len + 1);
-    memcpy(&line->data[line->size], s, len);
-    line->size += len;
-    line->data[line->size] = '\0';
-    eUpdateLine(line);
-    ++editorInfo.dirty;
+//What the lines of block b, starting at line start, leave unmatched.
+ebracket eBracketSum(int b, int start) {
+    ebrblock *blk = &editorInfo.brBlocks[b];
+    if (blk->dirty) {
+        blk->sum = (ebracket){0, 0};
+        for (int i = start; i < start + blk->count; ++i) {
+            blk->sum = eBracketJoin(blk->sum, editorInfo.line[i].br);
+        }
+        blk->dirty = false;
+    }
+    return blk->sum;
 }
 
-void eInsertChar(int c) {
-    if (c != '\t' && iscntrl(c)) {
+//Stores what a freshly lexed line leaves unmatched, and marks its block to be summed again.
+void eBracketSet(eline *line, const char *r, int n, const unsigned char *hl) {
+    ebracket br = eBracketScan(r, n, hl);
+    if (br.open == line->br.open && br.close == line->br.close) {
         return;
     }
 
-    if (editorInfo.cy == editorInfo.linecount) {
-        eInsertLine(editorInfo.linecount, NULL, 0);
+    line->br = br;
+    if (!editorInfo.brDirty && line->idx < editorInfo.linecount) {
+        int start;
+        editorInfo.brBlocks[eBracketBlock(line->idx, &start)].dirty = true;
     }
-
-    eLineInsertChar(&editorInfo.line[editorInfo.cy], editorInfo.cx, c);
-    ++editorInfo.cx;
 }
 
-void eInsertTab() {
-    bool useTrueTab = editorInfo.useTrueTab;
-    char *fnt = editorInfo.filenameTrunc;
+//Splits the file into blocks again. Only needed when every line may have changed; edits go through eBracketSplice.
+void eBracketBuild() {
+    int n = (editorInfo.linecount + BR_BLOCK - 1) / BR_BLOCK;
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > editorInfo.brBlockCap) {
+        editorInfo.brBlockCap = n;
+        editorInfo.brBlocks = (ebrblock*)realloc(editorInfo.brBlocks, sizeof(ebrblock) * n);
+    }
 
-    if (fnt && (strcmp(fnt, "Makefile") == 0 || strcmp(fnt, "makefile") == 0)) {
-        useTrueTab = true;
+    for (int b = 0; b < n; ++b) {
+        int left = editorInfo.linecount - b * BR_BLOCK;
+        editorInfo.brBlocks[b].count = left < BR_BLOCK ? left : BR_BLOCK;
+        editorInfo.brBlocks[b].dirty = true;
     }
+    editorInfo.brBlockCount = n;
+    editorInfo.brHint = 0;
+    editorInfo.brHintStart = 0;
+    editorInfo.brDirty = false;
+}
 
-    if (useTrueTab) {
-        eInsertChar('\t');
-    } else {
-        for (int i = 0; i < TAB_SIZE; ++i) {
-            eInsertChar(' ');
-        }
+//Makes room for n more blocks after block b.
+void eBracketGrow(int b, int n) {
+    if (editorInfo.brBlockCount + n > editorInfo.brBlockCap) {
+        int cap = editorInfo.brBlockCap * 2;
+        editorInfo.brBlockCap = cap > editorInfo.brBlockCount + n ? cap : editorInfo.brBlockCount + n;
+        editorInfo.brBlocks = (ebrblock*)realloc(editorInfo.brBlocks, sizeof(ebrblock) * editorInfo.brBlockCap);
     }
+    ebrblock *blk = editorInfo.brBlocks;
+    memmove(&blk[b + 1 + n], &blk[b + 1], sizeof(ebrblock) * (editorInfo.brBlockCount - b - 1));
+    editorInfo.brBlockCount += n;
 }
 
-void eDeleteChar() {
-    if (editorInfo.cy == editorInfo.linecount || (editorInfo.cx == 0 && editorInfo.cy == 0)) {
+//Lines [at, at + del) were replaced by ins others. Only the blocks they were in change size; one that grows too big
+//is split and one that shrinks too small is merged into the next.
+void eBracketSplice(int at, int del, int ins) {
+    if (editorInfo.brDirty) {
         return;
     }
 
-    eline *line = &editorInfo.line[editorInfo.cy];
-    if (editorInfo.cx > 0) {
-        eLineDeleteChar(line, editorInfo.cx - 1);
-        --editorInfo.cx;
-    } else {
-        editorInfo.cx = editorInfo.line[editorInfo.cy - 1].size;
-        eLineAppendString(&editorInfo.line[editorInfo.cy - 1], line->data, line->size);
-        eDeleteLine(editorInfo.cy);
-        --editorInfo.cy;
+    ebrblock *blk = editorInfo.brBlocks;
+    int s;
+    int b = eBracketBlock(at, &s);
+    int i = b, off = at - s;
+    while (del > 0 && i < editorInfo.brBlockCount) {
+        int take = blk[i].count - off < del ? blk[i].count - off : del;
+        blk[i].count -= take;
+        blk[i].dirty = true;
+        del -= take;
+        off = 0;
+        if (blk[i].count == 0 && editorInfo.brBlockCount > 1) {
+            memmove(&blk[i], &blk[i + 1], sizeof(ebrblock) * (editorInfo.brBlockCount - i - 1));
+            --editorInfo.brBlockCount;
+        } else {
+            ++i;
+        }
     }
-    
-    editorInfo.tx = editorInfo.cx;
-}
 
-void cls() {
-    write(STDOUT_FILENO, "\x1b]1337;CursorShape=0\x07", 21); //set cursor to a block, iTerm2 specific
-    write(STDOUT_FILENO, "\x1b[m", 3);
-    write(STDOUT_FILENO, "\x1b[2J", 4); //cls
-    write(STDOUT_FILENO, "\x1b[H", 3); //move cursor
+    //at is now either inside block b or at the end of the last one.
+    if (b >= editorInfo.brBlockCount) {
+        --b;
+        s -= blk[b].count;
+    }
+    blk[b].count += ins;
+    blk[b].dirty = true;
+
+    if (blk[b].count > BR_BLOCK * 2) {
+        int pieces = (blk[b].count + BR_BLOCK - 1) / BR_BLOCK;
+        int total = blk[b].count;
+        eBracketGrow(b, pieces - 1);
+        blk = editorInfo.brBlocks;
+        for (int p = 0; p < pieces; ++p) {
+            int left = total - p * BR_BLOCK;
+            blk[b + p].count = left < BR_BLOCK ? left : BR_BLOCK;
+            blk[b + p].dirty = true;
+        }
+    } else if (blk[b].count < BR_BLOCK / 4 && b + 1 < editorInfo.brBlockCount &&
+               blk[b].count + blk[b + 1].count <= BR_BLOCK * 2) {
+        blk[b].count += blk[b + 1].count;
+        memmove(&blk[b + 1], &blk[b + 2], sizeof(ebrblock) * (editorInfo.brBlockCount - b - 2));
+        --editorInfo.brBlockCount;
+    }
+
+    editorInfo.brHint = b;
+    editorInfo.brHintStart = s;
 }
 
-void die(const char *s) {
-    cls();
+//First line at or after from with as many unmatched closing brackets as the depth carried into it, updating depth
+//past every line skipped. Whole blocks that can't hold it are skipped on their sums. Returns -1 if there's none.
+int eBracketFindDown(int from, int *depth) {
+    if (from >= editorInfo.linecount) {
+        return -1;
+    }
 
-    perror(s);
-    exit(1);
-}
+    int s;
+    for (int b = eBracketBlock(from, &s); b < editorInfo.brBlockCount; s += editorInfo.brBlocks[b++].count) {
+        int end = s + editorInfo.brBlocks[b].count;
+        ebracket sum = eBracketSum(b, s);
+        if (s >= from && sum.close < *depth) {
+            *depth += sum.open - sum.close;
+            continue;
+        }
 
-void quit() {
-    exit(EXIT_SUCCESS);
+        for (int i = s > from ? s : from; i < end; ++i) {
+            ebracket br = editorInfo.line[i].br;
+            if (br.close >= *depth) {
+                return i;
+            }
+            *depth += br.open - br.close;
+        }
+    }
+
+    return -1;
 }
 
-void disableRawMode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editorInfo.origTermios) == -1) {
-        die("tcsetattr");
+//The same going up from the line before to.
+int eBracketFindUp(int to, int *depth) {
+    if (to <= 0) {
+        return -1;
     }
 
-    //write(STDOUT_FILENO, "\x1b[?9l", 5)
-    write(STDOUT_FILENO, "\x1b[?47l", 6);
-
-    cls();
+    int s;
+    int b = eBracketBlock(to - 1, &s);
+    while (true) {
+        int end = s + editorInfo.brBlocks[b].count;
+        ebracket sum = eBracketSum(b, s);
+        if (end <= to && sum.open < *depth) {
+            *depth += sum.close - sum.open;
+        } else {
+            for (int i = (end < to ? end : to) - 1; i >= s; --i) {
+                ebracket br = editorInfo.line[i].br;
+                if (br.open >= *depth) {
+                    return i;
+                }
+                *depth += br.close - br.open;
+            }
+        }
+        if (b == 0) {
+            return -1;
+        }
+        --b;
+        s -= editorInfo.brBlocks[b].count;
+    }
 }
 
-void enableRawMode() {
-    if (tcgetattr(STDIN_FILENO, &editorInfo.origTermios) == -1) {
-        die("tcgetattr");
+//Finds the bracket matching the one at render column rx of line y. Lines past the first only get searched through
+//the index, which needs every line's state to be exact; unless force is set this gives up rather than lexing the
+//rest of the file to get there.
+bool eBracketMatch(int y, int rx, int *my, int *mrx, bool force) {
+    eline *line = &editorInfo.line[y];
+    eLineReady(line);
+    if (rx >= line->rsize || !eIsCodeBracket(line->rdata, line->hl, rx)) {
+        return false;
     }
-    atexit(disableRawMode);
 
-    struct termios raw = editorInfo.origTermios;
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    char c = line->rdata[rx];
+    bool down = eIsOpenBracket(c);
+    int step = down ? 1 : -1;
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-        die("tcsetattr");
+    int depth = 0, at = -1;
+    for (int i = rx; i >= 0 && i < line->rsize; i += step) {
+        if (eIsCodeBracket(line->rdata, line->hl, i)) {
+            depth += eIsOpenBracket(line->rdata[i]) == down ? 1 : -1;
+            if (depth == 0) {
+                at = i;
+                break;
+            }
+        }
     }
 
-    write(STDOUT_FILENO, "\x1b[?47h", 6);
+    if (at == -1) {
+        if (!force && editorInfo.hlFrontier < editorInfo.linecount) {
+            return false;
+        } else if (editorInfo.hlFrontier < editorInfo.linecount) {
+            eHighlightParallel();
+        }
+        if (editorInfo.brDirty) {
+            eBracketBuild();
+        }
+
+        if (down) {
+            y = eBracketFindDown(y + 1, &depth);
+        } else {
+            y = eBracketFindUp(y, &depth);
+        }
+        if (y == -1) {
+            return false;
+        }
+
+        line = &editorInfo.line[y];
+        eLineReady(line);
+        for (int i = down ? 0 : line->rsize - 1; i >= 0 && i < line->rsize; i += step) {
+            if (eIsCodeBracket(line->rdata, line->hl, i)) {
+                depth += eIsOpenBracket(line->rdata[i]) == down ? 1 : -1;
+                if (depth == 0) {
+                    at = i;
+                    break;
+                }
+            }
+        }
+        if (at == -1) {
+            return false;
+        }
+    }
+
+    //Brackets nest as one kind, so a mismatched pair means the code around them doesn't balance.
+    const char *pairs = "()[]{}";
+    int k = (int)(strchr(pairs, c) - pairs);
+    if (line->rdata[at] != pairs[k ^ 1]) {
+        return false;
+    }
+
+    *my = y;
+    *mrx = at;
+    return true;
 }
 
-void eSetStatus(const char *fmt, ...) {
-    if (fmt == NULL) {
+//Jumps to the bracket matching the one under the cursor, or the next one on the line.
+void eBracketJump() {
+    if (editorInfo.cy >= editorInfo.linecount) {
         return;
     }
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(editorInfo.statusmsg, sizeof(editorInfo.statusmsg), fmt, args);
-    va_end(args);
-    editorInfo.statusmsgTime = time(NULL);
-}
+    eline *line = &editorInfo.line[editorInfo.cy];
+    eLineReady(line);
+    int rx = eCxToRx(line, editorInfo.cx);
+    while (rx < line->rsize && !eIsCodeBracket(line->rdata, line->hl, rx)) {
+        ++rx;
+    }
+    if (rx >= line->rsize) {
+        eSetError("No bracket under the cursor");
+        return;
+    }
 
-void eSetError(const char *fmt, ...) {
-    if (fmt == NULL) {
+    int my, mrx;
+    if (!eBracketMatch(editorInfo.cy, rx, &my, &mrx, true)) {
+        eSetError("No matching bracket");
         return;
     }
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(editorInfo.statusmsg, sizeof(editorInfo.statusmsg), fmt, args);
-    va_end(args);
-    editorInfo.statusmsgTime = time(NULL);
-    editorInfo.statuserror = true;
+    editorInfo.cy = my;
+    editorInfo.cx = eRxToCx(&editorInfo.line[my], mrx);
 }
 
-char *ePrompt(const char *prompt, void (*callback)(char *, int)) {
-    if (prompt == NULL) {
-        return NULL;
+//Sets the state a line leaves. A line is exact if the state it started from was, and lines above the frontier are all
+//exact. When a line hands on a different state, or one that's no longer exact, the next one has to be lexed again.
+//Returns whether anything changed.
+bool eHighlightSet(eline *line, int state, bool exact) {
+    bool moved = line->hlOpenComment != state;
+    bool lost = line->hlExact && !exact;
+    bool changed = moved || line->hlExact != exact;
+    line->hlOpenComment = state;
+    line->hlExact = exact;
+
+    int next = line->idx + 1;
+    if (exact && line->idx == editorInfo.hlFrontier) {
+        editorInfo.hlFrontier = next;
+    }
+    if ((moved || lost) && next != editorInfo.hlFrontier) {
+        editorInfo.hlResume = false;
+    }
+    if ((moved || lost) && next < editorInfo.linecount) {
+        editorInfo.line[next].hlExact = false;
+        if (next < editorInfo.hlFrontier) {
+            editorInfo.hlFrontier = next;
+        }
     }
-    
-    editorInfo.statuserror = false;
-    firstMessage = false;
 
-    size_t bufsize = 128;
-    char *buf = (char*)malloc(bufsize);
+    //Everything past a single rewind was exact already, so once the state it hands on is what it was the frontier can
+    //go back to the end.
+    if (editorInfo.hlResume && exact && !moved && next == editorInfo.hlFrontier &&
+        (next == editorInfo.linecount || editorInfo.line[next].hlExact)) {
+        editorInfo.hlFrontier = editorInfo.linecount;
+        editorInfo.hlResume = false;
+    }
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+    return changed;
+}
 
-    while (true) {
-        eSetStatus(prompt, buf);
-        ecls();
+//After lines [at, at + del) were replaced by ins others, the new ones and the line after them start from states
+//nobody has checked yet.
+void eHighlightRewind(int at, int del, int ins) {
+    editorInfo.hlResume = at < editorInfo.hlFrontier && editorInfo.hlFrontier >= editorInfo.linecount - ins + del;
+    if (at < editorInfo.hlFrontier) {
+        editorInfo.hlFrontier = at;
+    }
+    if (at + ins < editorInfo.linecount) {
+        editorInfo.line[at + ins].hlExact = false;
+    }
+    eBracketSplice(at, del, ins);
+}
 
-        int k = eReadKey();
-        if (k == vk_delete || k == CTRL_KEY('h') || k == vk_backspace) {
-            if (buflen != 0) {
-                buf[--buflen] = '\0';
-            }
-        } else if (k == vk_escape) {
-            eSetStatus("");
-            if (callback) {
-                callback(buf, k);
-            }
-            free(buf);
+//Highlights a single line and returns whether the state it leaves for the next line changed.
+bool eHighlightLine(eline *line) {
+    eLineTouch(line);
+    line->hl = (unsigned char*)realloc(line->hl, line->rsize);
+    memset(line->hl, HLNormal, line->rsize);
 
-            return NULL;
-        } else if (k == vk_enter) {
-            if (buflen != 0) {
-                eSetStatus("");
-                if (callback) {
-                    callback(buf, k);
-                }
-                return buf;
-            }
-        } else if (!iscntrl(k) && k < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = (char*)realloc(buf, bufsize);
-            }
+    if (editorInfo.syntax == NULL || editorInfo.syntax->lex == NULL) {
+        eBracketSet(line, line->rdata, line->rsize, NULL);
+        return false;
+    }
+
+    eline *prev = line->idx > 0 ? &editorInfo.line[line->idx - 1] : NULL;
+    int state = eLexLine(editorInfo.syntax->lex, line->rdata, line->rsize, line->hl, prev ? prev->hlOpenComment : LexInCode);
+    eBracketSet(line, line->rdata, line->rsize, line->hl);
+    return eHighlightSet(line, state, prev == NULL || prev->hlExact);
+}
+
+//Lexes a line only for the state it leaves and its brackets, without keeping its colors or decompressing it. Tabs
+//don't matter to the lexer, so the raw data does. Without a syntax only the brackets are counted.
+bool eHighlightState(eline *line) {
+    static unsigned char *scratch = NULL;
+    static int scratchCap = 0;
+    char *data = eLineDataTemp(line);
+    eline *prev = line->idx > 0 ? &editorInfo.line[line->idx - 1] : NULL;
+
+    if (editorInfo.syntax == NULL || editorInfo.syntax->lex == NULL) {
+        eBracketSet(line, data, line->size, NULL);
+        return eHighlightSet(line, LexInCode, prev == NULL || prev->hlExact);
+    }
+
+    if (line->size > scratchCap) {
+        scratchCap = line->size * 2;
+        scratch = (unsigned char*)realloc(scratch, scratchCap);
+    }
+
+    memset(scratch, HLNormal, line->size);
+    int state = eLexLine(editorInfo.syntax->lex, data, line->size, scratch, prev ? prev->hlOpenComment : LexInCode);
+    eBracketSet(line, data, line->size, scratch);
+    return eHighlightSet(line, state, prev == NULL || prev->hlExact);
+}
+
+void eUpdateSyntax(eline *line) {
+    ++editorInfo.generation;
+    while (eHighlightLine(line) && line->idx + 1 < editorInfo.linecount) {
+        line = &editorInfo.line[line->idx + 1];
+
+        //Lines nobody has highlighted yet are left for when they're drawn or for the background pass.
+        if (line->hl == NULL && !line->hlExact) {
+            break;
+        }
+    }
+}
+
+//Highlights the lines [start, end) in order and only keeps going past the end while the open comment state changes.
+void eUpdateSyntaxRange(int start, int end) {
+    bool changed = false;
+    for (int i = start; i < end && i < editorInfo.linecount; ++i) {
+        changed = eHighlightLine(&editorInfo.line[i]);
+    }
+
+    if (changed && end < editorInfo.linecount) {
+        eUpdateSyntax(&editorInfo.line[end]);
+    }
+}
+
+int syntaxToColor(int hl) {
+    switch (hl) {
+        case HLComment:
+        case HLMLComment: return 28;
+        case HLKeywords: return 124;
+        case HLType: return 166;
+        case HLMacro: return 29;
+        case HLString: return 34;
+        case HLNumber: return 90;
+        case HLMatch: return 198;
+        case HLDollar: return 208;
+        default: return 37;
+    }
+}
+
+//Drops every line's highlighting. The visible rows get highlighted when they're drawn and the rest in the background.
+void eHighlightReset() {
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        eline *line = &editorInfo.line[i];
+        free(line->hl);
+        line->hl = NULL;
+        line->hlOpenComment = LexInCode;
+        line->hlExact = false;
+    }
+    editorInfo.hlFrontier = 0;
+    editorInfo.hlResume = false;
+    editorInfo.brDirty = true;
+    ++editorInfo.generation;
+}
+
+void eSelectSyntaxHL() {
+    editorInfo.syntax = NULL;
+    if (editorInfo.filename == NULL) {
+        return;
+    }
+
+    eSyntaxLoadAll();
+    char *ext = strrchr(editorInfo.filename, '.');
+
+    for (int i = 0; i < syntaxCount; ++i) {
+        editorSyntax *s = &syntaxes[i];
+        unsigned int idx = 0;
+        while (s->filematch[idx]) {
+            bool isExt = (s->filematch[idx][0] == '.');
+
+            if ((isExt && ext && !strcmp(ext, s->filematch[idx])) || (!isExt && strstr(editorInfo.filename, s->filematch[idx]))) {
+                if (eSyntaxLexer(s) == NULL) {
+                    return;
+                }
+
+                eSetStatus(ext);
+                editorInfo.syntax = s;
+                eHighlightReset();
+                return;
+            }
+
+            ++idx;
+        }
+    }
+}
+
+void eMoveToEndOfLine(int idx) {
+    editorInfo.cy = idx;
+    eline *line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
+    int linelen = line ? line->size : 0;
+    editorInfo.cx = linelen;
+    editorInfo.tx = editorInfo.cx;
+}
+
+void eMoveToBeginningOfLine(int idx) {
+    editorInfo.cy = idx;
+    editorInfo.cx = 0;
+    editorInfo.tx = editorInfo.cx;
+}
+
+unsigned int eRead32(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+unsigned char *eLZPutLength(unsigned char *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+
+    return op;
+}
+
+//LZ4 style block compressor: a token with 4 bits each of literal and match length, the literals, then a 2 byte offset.
+//The last sequence is only literals. dst needs room for len + len / 255 + 16 bytes.
+int eLZCompress(const unsigned char *src, int len, unsigned char *dst) {
+    int table[1 << ZHASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + len;
+    unsigned char *op = dst;
+
+    while (ip + 4 <= end) {
+        unsigned int seq = eRead32(ip);
+        unsigned int h = (seq * 2654435761u) >> (32 - ZHASH_BITS);
+        int ref = table[h];
+        table[h] = (int)(ip - src);
+
+        if (ref < 0 || (ip - src) - ref > 65535 || eRead32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        const unsigned char *m = src + ref + 4;
+        const unsigned char *p = ip + 4;
+        while (p < end && *p == *m) {
+            ++p;
+            ++m;
+        }
+
+        int litlen = (int)(ip - anchor);
+        int mlen = (int)(p - ip) - 4;
+        int offset = (int)(ip - (src + ref));
+
+        unsigned char *token = op++;
+        *token = (unsigned char)(((litlen >= 15 ? 15 : litlen) << 4) | (mlen >= 15 ? 15 : mlen));
+        if (litlen >= 15) {
+            op = eLZPutLength(op, litlen - 15);
+        }
+        memcpy(op, anchor, litlen);
+        op += litlen;
+
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (mlen >= 15) {
+            op = eLZPutLength(op, mlen - 15);
+        }
+
+        ip = p;
+        anchor = p;
+    }
+
+    int litlen = (int)(end - anchor);
+    *op++ = (unsigned char)((litlen >= 15 ? 15 : litlen) << 4);
+    if (litlen >= 15) {
+        op = eLZPutLength(op, litlen - 15);
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return (int)(op - dst);
+}
+
+bool eLZDecompress(const unsigned char *src, int zlen, char *dst, int rawlen) {
+    const unsigned char *ip = src;
+    const unsigned char *zend = src + zlen;
+    char *op = dst;
+    char *end = dst + rawlen;
+
+    while (ip < zend) {
+        int token = *ip++;
+
+        int litlen = token >> 4;
+        if (litlen == 15) {
+            int b;
+            do {
+                b = *ip++;
+                litlen += b;
+            } while (b == 255 && ip < zend);
+        }
+
+        if (litlen > end - op || litlen > zend - ip) {
+            return false;
+        }
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        if (ip >= zend) {
+            break;
+        }
+
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                b = *ip++;
+                mlen += b;
+            } while (b == 255 && ip < zend);
+        }
+        mlen += 4;
+
+        if (offset == 0 || offset > op - dst || mlen > end - op) {
+            return false;
+        }
+
+        //Matches can overlap what they're copying.
+        char *m = op - offset;
+        while (mlen--) {
+            *op++ = *m++;
+        }
+    }
+
+    return op == end;
+}
+
+unsigned char *eZBlockData(ezblock *b) {
+    return (unsigned char*)(b + 1);
+}
+
+//The last block decompressed on the main thread, since neighbouring lines usually get touched together.
+struct {
+    ezblock *block;
+    char *raw;
+    int cap;
+} zcache;
+
+void eZBlockRelease(ezblock *b) {
+    if (--b->refs > 0) {
+        return;
+    }
+
+    if (zcache.block == b) {
+        zcache.block = NULL;
+    }
+    free(b);
+}
+
+char *eZBlockRaw(ezblock *b) {
+    if (zcache.block != b) {
+        if (zcache.cap < b->rawlen) {
+            zcache.cap = b->rawlen;
+            zcache.raw = (char*)realloc(zcache.raw, zcache.cap);
+        }
+
+        if (!eLZDecompress(eZBlockData(b), b->zlen, zcache.raw, b->rawlen)) {
+            die("decompress");
+        }
+        zcache.block = b;
+    }
+
+    return zcache.raw;
+}
+
+//Returns a line's data without making it resident. Only valid until the next call.
+char *eLineDataTemp(eline *line) {
+    if (line->zblock == NULL) {
+        return line->data;
+    }
+
+    return eZBlockRaw(line->zblock) + line->zoff;
+}
+
+int eRenderSize(const char *data, int size) {
+    int tabs = 0;
+    for (int i = 0; i < size; ++i) {
+        if (data[i] == '\t') {
+            ++tabs;
+        }
+    }
+
+    return size + tabs * (TAB_SIZE - 1) + 4;
+}
+
+//Expands tabs. out needs eRenderSize bytes.
+int eRenderTabs(const char *data, int size, char *out) {
+    int idx = 0;
+    for (int j = 0; j < size; ++j) {
+        if (data[j] == '\t') {
+            out[idx++] = ' ';
+            while (idx % TAB_SIZE != 0) {
+                out[idx++] = ' ';
+            }
+
+            /* Adds ┊ but messes up cursor movement.
+            out[idx++] = '\xE2';
+            out[idx++] = '\x94';
+            out[idx++] = '\x8A';
+            */
+        } else {
+            out[idx++] = data[j];
+        }
+    }
+
+    out[idx] = '\0';
+
+    return idx;
+}
+
+//Returns a line's rendered text without making it resident. Only valid until the next call.
+char *eLineRenderTemp(eline *line, int *rsize) {
+    static char *buf = NULL;
+    static int cap = 0;
+
+    if (line->zblock == NULL) {
+        *rsize = line->rsize;
+        return line->rdata;
+    }
+
+    char *data = eLineDataTemp(line);
+    int need = eRenderSize(data, line->size);
+    if (need > cap) {
+        cap = need * 2;
+        buf = (char*)realloc(buf, cap);
+    }
+
+    *rsize = eRenderTabs(data, line->size, buf);
+
+    return buf;
+}
+
+long long eTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned int eTrigramHash(const char *s) {
+    unsigned int t = ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (t * 2654435761u) >> (32 - 18);
+}
+
+void ePostingAdd(eposting *p, int uid) {
+    if (p->len > 0 && p->last == uid) {
+        return;
+    }
+
+    if (p->len + 5 > p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 16;
+        p->buf = (unsigned char*)realloc(p->buf, p->cap);
+    }
+
+    unsigned int delta = (unsigned int)(p->len > 0 ? uid - p->last : uid);
+    while (delta >= 0x80) {
+        p->buf[p->len++] = (unsigned char)(delta | 0x80);
+        delta >>= 7;
+    }
+    p->buf[p->len++] = (unsigned char)delta;
+    p->last = uid;
+}
+
+void eTrigramFree() {
+    etrigram *t = editorInfo.trigram;
+    if (t == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < TRIGRAM_BUCKETS; ++i) {
+        free(t->buckets[i].buf);
+    }
+    free(t->buckets);
+    free(t->uidIdx);
+    free(t->cacheQuery);
+    free(t->cand);
+    free(t);
+
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        editorInfo.line[i].uid = -1;
+    }
+
+    editorInfo.trigram = NULL;
+}
+
+//Starts a fresh index. The lines themselves get indexed in the background by eTrigramIdle.
+void eTrigramStart() {
+    eTrigramFree();
+
+    etrigram *t = (etrigram*)calloc(1, sizeof(etrigram));
+    t->buckets = (eposting*)calloc(TRIGRAM_BUCKETS, sizeof(eposting));
+    editorInfo.trigram = t;
+}
+
+bool eTrigramReady() {
+    return editorInfo.trigram != NULL && editorInfo.trigram->next >= editorInfo.linecount;
+}
+
+void eTrigramRetire(eline *line) {
+    etrigram *t = editorInfo.trigram;
+    if (t == NULL || line->uid < 0) {
+        return;
+    }
+
+    t->uidIdx[line->uid] = -1;
+    line->uid = -1;
+    ++t->dead;
+    ++t->gen;
+}
+
+void eTrigramAddLine(eline *line) {
+    etrigram *t = editorInfo.trigram;
+
+    eTrigramRetire(line);
+
+    if (t->uidCount == t->uidCap) {
+        t->uidCap = t->uidCap ? t->uidCap * 2 : 1024;
+        t->uidIdx = (int*)realloc(t->uidIdx, sizeof(int) * t->uidCap);
+    }
+
+    line->uid = t->uidCount++;
+    t->uidIdx[line->uid] = line->idx;
+    ++t->gen;
+
+    int rsize;
+    char *rdata = eLineRenderTemp(line, &rsize);
+    for (int i = 0; i + 2 < rsize; ++i) {
+        ePostingAdd(&t->buckets[eTrigramHash(&rdata[i])], line->uid);
+    }
+}
+
+//Called whenever a line's contents change.
+void eTrigramUpdateLine(eline *line) {
+    etrigram *t = editorInfo.trigram;
+    if (t != NULL && line->idx < t->next) {
+        eTrigramAddLine(line);
+    }
+}
+
+void eTrigramInsertLine(int idx) {
+    etrigram *t = editorInfo.trigram;
+    if (t == NULL) {
+        return;
+    }
+
+    if (idx < t->next) {
+        ++t->next;
+    }
+    ++t->gen;
+}
+
+void eTrigramDeleteLine(int idx) {
+    etrigram *t = editorInfo.trigram;
+    if (t == NULL) {
+        return;
+    }
+
+    eTrigramRetire(&editorInfo.line[idx]);
+    if (idx < t->next) {
+        --t->next;
+    }
+}
+
+//Indexes lines for a bounded amount of time. Returns true if there's more to do.
+bool eTrigramIdle(long long deadline) {
+    etrigram *t = editorInfo.trigram;
+    if (t == NULL) {
+        return false;
+    }
+
+    //Too many retired uids means the posting lists are mostly garbage, so start over.
+    if (t->next >= editorInfo.linecount && t->dead > t->uidCount / 2 && t->dead > 65536) {
+        eTrigramStart();
+        t = editorInfo.trigram;
+    }
+
+    while (t->next < editorInfo.linecount) {
+        eTrigramAddLine(&editorInfo.line[t->next]);
+        ++t->next;
+
+        if ((t->next & 1023) == 0 && eTimeUs() > deadline) {
+            break;
+        }
+    }
+
+    return t->next < editorInfo.linecount;
+}
+
+int eCompareInt(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+//Collects the sorted lines that may contain q, using the rarest of its trigrams.
+void eTrigramCandidates(const char *q) {
+    etrigram *t = editorInfo.trigram;
+    if (t->cacheQuery && t->cacheGen == t->gen && strcmp(t->cacheQuery, q) == 0) {
+        return;
+    }
+
+    eposting *best = NULL;
+    int qlen = (int)strlen(q);
+    for (int i = 0; i + 2 < qlen; ++i) {
+        eposting *p = &t->buckets[eTrigramHash(&q[i])];
+        if (best == NULL || p->len < best->len) {
+            best = p;
+        }
+    }
+
+    t->candCount = 0;
+    t->cand = (int*)realloc(t->cand, sizeof(int) * (best->len + 1));
+
+    int uid = 0;
+    int i = 0;
+    while (i < best->len) {
+        unsigned int delta = 0;
+        int shift = 0;
+        while (best->buf[i] & 0x80) {
+            delta |= (unsigned int)(best->buf[i++] & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (unsigned int)best->buf[i++] << shift;
+        uid += (int)delta;
+
+        if (t->uidIdx[uid] != -1) {
+            t->cand[t->candCount++] = t->uidIdx[uid];
+        }
+    }
+
+    qsort(t->cand, t->candCount, sizeof(int), eCompareInt);
+
+    free(t->cacheQuery);
+    t->cacheQuery = strdup(q);
+    t->cacheGen = t->gen;
+}
+
+//Finds the next line after 'from' in 'direction' that contains q, wrapping around. Returns -1 if there's none.
+int eTrigramFind(const char *q, int from, int direction) {
+    etrigram *t = editorInfo.trigram;
+    eTrigramCandidates(q);
+
+    if (t->candCount == 0) {
+        return -1;
+    }
+
+    //First candidate > from.
+    int lo = 0;
+    int hi = t->candCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->cand[mid] <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int pos = direction > 0 ? lo : lo - 1;
+    if (direction < 0 && lo > 0 && t->cand[lo - 1] == from) {
+        --pos;
+    }
+
+    for (int n = 0; n < t->candCount; ++n) {
+        pos = (pos + t->candCount) % t->candCount;
+        int rsize;
+        if (strstr(eLineRenderTemp(&editorInfo.line[t->cand[pos]], &rsize), q)) {
+            return t->cand[pos];
+        }
+        pos += direction;
+    }
+
+    return -1;
+}
+
+//Background work done while waiting for input. Returns true if there's more to do.
+bool eIdle() {
+    long long deadline = eTimeUs() + IDLE_SLICE_US;
+    bool more = false;
+
+    more |= eTrigramIdle(deadline);
+    more |= eStreamIdle(deadline);
+    more |= eCompressIdle(deadline);
+    more |= eHighlightIdle(deadline);
+    eFollowIdle();
+    eDiskIdle();
+    eIndexIdle();
+    eViewIdle();
+    eSaveIdle();
+
+    return more;
+}
+
+void eRenderLine(eline *line) {
+    free(line->rdata);
+    line->rdata = (char*)malloc(eRenderSize(line->data, line->size));
+    line->rsize = eRenderTabs(line->data, line->size, line->rdata);
+}
+
+void eUpdateRender(eline *line) {
+    ++editorInfo.generation;
+    eRenderLine(line);
+    eTrigramUpdateLine(line);
+}
+
+void eUpdateLine(eline *line) {
+    if (txn.depth > 0) {
+        if (!line->stale) {
+            line->stale = true;
+            if (txn.count == txn.cap) {
+                txn.cap = txn.cap ? txn.cap * 2 : 64;
+                txn.lines = (int*)realloc(txn.lines, sizeof(int) * txn.cap);
+            }
+            txn.lines[txn.count++] = line->idx;
+        }
+        return;
+    }
+
+    eUpdateRender(line);
+    eUpdateSyntax(line);
+}
+
+//Moves the extra cursors along when [at, at + del) is replaced by ins lines. Ones on deleted lines go to the start
+//of the first line after the edit, and any that end up together become one.
+void eCursorShift(int at, int del, int ins) {
+    int count = editorInfo.linecount - del + ins;
+    ecursor *c = editorInfo.cursors;
+    int n = 0;
+    for (int i = 0; i < editorInfo.cursorCount; ++i) {
+        ecursor cur = c[i];
+        if (cur.cy >= at + del) {
+            cur.cy += ins - del;
+        } else if (cur.cy >= at) {
+            if (count == 0) {
+                continue;
+            }
+            cur.cy = at < count ? at : count - 1;
+            cur.cx = cur.tx = 0;
+        }
+
+        //Shifting keeps them in order, so only neighbours can collide.
+        if (n == 0 || eCursorCmp(&c[n - 1], &cur) != 0) {
+            c[n++] = cur;
+        }
+    }
+    editorInfo.cursorCount = n;
+}
+
+//Keeps the lines a transaction has touched, and the extra cursors, pointing at the right lines when [at, at + del) is
+//replaced by ins lines.
+void eTxnShift(int at, int del, int ins) {
+    ++editorInfo.generation;
+    if (editorInfo.cursorCount > 0) {
+        eCursorShift(at, del, ins);
+    }
+
+    int n = 0;
+    for (int i = 0; i < txn.count; ++i) {
+        int idx = txn.lines[i];
+        if (idx >= at && idx < at + del) {
+            continue;
+        }
+
+        txn.lines[n++] = idx >= at + del ? idx + ins - del : idx;
+    }
+    txn.count = n;
+}
+
+//Edits between eBeginEdit and eCommitEdit only mark the lines they touch.
+void eBeginEdit() {
+    ++txn.depth;
+}
+
+//Renders and highlights the lines touched so far, in line order. A highlight cascade only runs past a touched line
+//if the next line wasn't touched too.
+void eFlushEdits() {
+    if (txn.count == 0) {
+        return;
+    }
+
+    qsort(txn.lines, txn.count, sizeof(int), eCompareInt);
+    for (int i = 0; i < txn.count; ++i) {
+        eline *line = &editorInfo.line[txn.lines[i]];
+        line->stale = false;
+        eUpdateRender(line);
+    }
+
+    for (int i = 0; i < txn.count; ++i) {
+        int idx = txn.lines[i];
+        bool nextTouched = i + 1 < txn.count && txn.lines[i + 1] == idx + 1;
+        if (eHighlightLine(&editorInfo.line[idx]) && !nextTouched && idx + 1 < editorInfo.linecount) {
+            eUpdateSyntax(&editorInfo.line[idx + 1]);
+        }
+    }
+
+    txn.count = 0;
+}
+
+void eCommitEdit() {
+    if (--txn.depth == 0) {
+        eFlushEdits();
+    }
+}
+
+//Lines loaded from a file point into one big arena until they're first edited.
+bool eLineInArena(eline *line) {
+    return line->data >= editorInfo.arena && line->data < editorInfo.arena + editorInfo.arenaSize;
+}
+
+bool eLineShared(eline *line) {
+    return saveJob.active && line->cowSeq != editorInfo.snapshotSeq;
+}
+
+void eSaveOrphan(char *data) {
+    if (saveJob.orphanCount == saveJob.orphanCap) {
+        saveJob.orphanCap = saveJob.orphanCap ? saveJob.orphanCap * 2 : 64;
+        saveJob.orphans = (char**)realloc(saveJob.orphans, sizeof(char*) * saveJob.orphanCap);
+    }
+
+    saveJob.orphans[saveJob.orphanCount++] = data;
+}
+
+void eArenaRelease() {
+    if (--editorInfo.arenaRefs > 0) {
+        return;
+    }
+
+    if (saveJob.active) {
+        eSaveOrphan(editorInfo.arena);
+    } else {
+        free(editorInfo.arena);
+    }
+
+    editorInfo.arena = NULL;
+    editorInfo.arenaSize = 0;
+}
+
+//Gives a line its own copy of its data if it's still in the arena or part of a running save's snapshot.
+void eLineCopyOut(eline *line) {
+    bool inArena = eLineInArena(line);
+    bool shared = eLineShared(line);
+    if (!inArena && !shared) {
+        return;
+    }
+
+    char *data = (char*)malloc(line->size + 1);
+    memcpy(data, line->data, line->size);
+    data[line->size] = '\0';
+
+    if (inArena) {
+        eArenaRelease();
+    } else {
+        eSaveOrphan(line->data);
+    }
+    line->data = data;
+    line->cowSeq = editorInfo.snapshotSeq;
+}
+
+//Decompresses a line if it's been compressed. Its highlighting is left for eHighlightLine to redo.
+void eLineTouch(eline *line) {
+    if (line->zblock == NULL) {
+        return;
+    }
+
+    char *data = (char*)malloc(line->size + 1);
+    memcpy(data, eLineDataTemp(line), line->size + 1);
+    eZBlockRelease(line->zblock);
+
+    line->zblock = NULL;
+    line->data = data;
+    line->cowSeq = editorInfo.snapshotSeq;
+    eRenderLine(line);
+    ++editorInfo.zTouched;
+}
+
+//Makes sure a line can be drawn.
+void eLineReady(eline *line) {
+    eLineTouch(line);
+    if (line->hl != NULL) {
+        return;
+    }
+
+    //Start from the nearest line above whose state is known, but only look back so far. A guess past that gets fixed
+    //once the background pass catches up.
+    int lo = line->idx > HL_BACKSCAN ? line->idx - HL_BACKSCAN : 0;
+    int start = line->idx;
+    while (start > lo && !editorInfo.line[start - 1].hlExact && editorInfo.line[start - 1].hl == NULL) {
+        --start;
+    }
+
+    if (editorInfo.syntax && editorInfo.syntax->lex) {
+        for (int i = start; i < line->idx; ++i) {
+            eHighlightState(&editorInfo.line[i]);
+        }
+    }
+    eHighlightLine(line);
+}
+
+//Highlights around the view first, then moves the frontier down the file so every line's state ends up exact.
+//Returns true if there's more to do.
+bool eHighlightIdle(long long deadline) {
+    int lo = editorInfo.yoffset > editorInfo.h ? editorInfo.yoffset - editorInfo.h : 0;
+    int hi = editorInfo.yoffset + editorInfo.h * 2;
+    for (int i = lo; i < hi && i < editorInfo.linecount && eTimeUs() < deadline; ++i) {
+        if (editorInfo.line[i].hl == NULL && editorInfo.line[i].zblock == NULL) {
+            eLineReady(&editorInfo.line[i]);
+        }
+    }
+
+    //Bracket matches past the view only show once every state is exact.
+    bool behind = editorInfo.hlFrontier < editorInfo.linecount;
+    while (editorInfo.hlFrontier < editorInfo.linecount && eTimeUs() < deadline) {
+        for (int n = 0; n < 1024 && editorInfo.hlFrontier < editorInfo.linecount; ++n) {
+            int idx = editorInfo.hlFrontier++;
+            eline *line = &editorInfo.line[idx];
+            if (line->hlExact) {
+                continue;
+            }
+
+            //Lines that already have colors get them fixed, the rest only need their state.
+            if (line->hl != NULL) {
+                eHighlightLine(line);
+                if (idx >= editorInfo.yoffset && idx < editorInfo.yoffset + editorInfo.h) {
+                    needsRedraw = true;
+                }
+            } else {
+                eHighlightState(line);
+            }
+        }
+    }
+
+    if (behind && editorInfo.hlFrontier == editorInfo.linecount) {
+        needsRedraw = true;
+    }
+    return editorInfo.hlFrontier < editorInfo.linecount;
+}
+
+typedef struct ehlchunk {
+    const elexer *lex;
+    int start;
+    int end;
+    int entry;
+    bool converge;
+    int *states;
+    ezblock *block;
+    char *raw;
+    int rawCap;
+    unsigned char *scratch;
+    int scratchCap;
+    abuf *out;
+} ehlchunk;
+
+//Appends a line to ab with its highlighting as terminal colors.
+void eExportLine(abuf *ab, const char *data, int size, const unsigned char *hl) {
+    char esc[16];
+    int color = -1;
+    int run = 0;
+    for (int j = 0; j < size; ++j) {
+        int c = hl[j] == HLNormal ? -1 : syntaxToColor(hl[j]);
+        if (c != color) {
+            abAppend(ab, &data[run], j - run);
+            run = j;
+            color = c;
+            if (c == -1) {
+                abAppend(ab, "\x1b[39m", 5);
+            } else {
+                abAppend(ab, esc, snprintf(esc, sizeof(esc), "\x1b[38;5;%dm", c));
+            }
+        }
+    }
+    abAppend(ab, &data[run], size - run);
+    abAppend(ab, color == -1 ? "\n" : "\x1b[39m\n", color == -1 ? 1 : 6);
+}
+
+//Lexes the lines [start, end) from the entry state, stores the state each one leaves and counts its brackets. Compressed
+//lines are decompressed into the chunk's own buffer, since the shared one belongs to the main thread. If converge is
+//set this stops at the first line that leaves the state already stored, as everything below it would come out the same.
+//With out set the states are taken as right and the lines are written there in color instead.
+void *eHighlightChunk(void *arg) {
+    ehlchunk *c = (ehlchunk*)arg;
+
+    int state = c->entry;
+    for (int i = c->start; i < c->end; ++i) {
+        eline *line = &editorInfo.line[i];
+        char *data = line->data;
+        if (line->zblock != NULL) {
+            ezblock *b = line->zblock;
+            if (c->block != b) {
+                if (c->rawCap < b->rawlen) {
+                    c->rawCap = b->rawlen;
+                    c->raw = (char*)realloc(c->raw, c->rawCap);
+                }
+                if (!eLZDecompress(eZBlockData(b), b->zlen, c->raw, b->rawlen)) {
+                    die("decompress");
+                }
+                c->block = b;
+            }
+            data = c->raw + line->zoff;
+        }
+
+        if (c->lex == NULL) {
+            line->br = eBracketScan(data, line->size, NULL);
+            c->states[i] = LexInCode;
+            continue;
+        }
+
+        if (line->size > c->scratchCap) {
+            c->scratchCap = line->size * 2;
+            c->scratch = (unsigned char*)realloc(c->scratch, c->scratchCap);
+        }
+
+        memset(c->scratch, HLNormal, line->size);
+        state = eLexLine(c->lex, data, line->size, c->scratch, state);
+        if (c->out != NULL) {
+            eExportLine(c->out, data, line->size, c->scratch);
+            continue;
+        }
+        line->br = eBracketScan(data, line->size, c->scratch);
+        if (c->converge && c->states[i] == state) {
+            break;
+        }
+        c->states[i] = state;
+    }
+
+    return NULL;
+}
+
+//Works out the state of every line from the frontier down at once. Each chunk is lexed on its own thread as if it
+//started outside any comment or string, then the chunks that guessed wrong are lexed again in order from the state
+//the one above really left, which usually settles within a few lines.
+void eHighlightParallel() {
+    int from = editorInfo.hlFrontier;
+    int count = editorInfo.linecount;
+    if (from >= count) {
+        return;
+    }
+
+    int n = eLoadThreads(count - from, HL_MIN_CHUNK);
+
+    int *states = (int*)malloc(sizeof(int) * count);
+    ehlchunk chunks[LOAD_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int i = 0; i < n; ++i) {
+        chunks[i].lex = editorInfo.syntax ? editorInfo.syntax->lex : NULL;
+        chunks[i].start = from + (int)((long long)(count - from) * i / n);
+        chunks[i].end = from + (int)((long long)(count - from) * (i + 1) / n);
+        chunks[i].entry = LexInCode;
+        chunks[i].states = states;
+    }
+    if (from > 0) {
+        chunks[0].entry = editorInfo.line[from - 1].hlOpenComment;
+    }
+
+    eLoadRun(eHighlightChunk, chunks, sizeof(ehlchunk), n);
+
+    for (int i = 1; i < n; ++i) {
+        int entry = states[chunks[i].start - 1];
+        if (entry != chunks[i].entry) {
+            chunks[i].entry = entry;
+            chunks[i].converge = true;
+            eHighlightChunk(&chunks[i]);
+        }
+    }
+
+    //Colors worked out from a state that has since changed are dropped and redone when they're drawn.
+    int prevOld = chunks[0].entry, prevNew = chunks[0].entry;
+    for (int i = from; i < count; ++i) {
+        eline *line = &editorInfo.line[i];
+        if (line->hl != NULL && (!line->hlExact || prevOld != prevNew)) {
+            free(line->hl);
+            line->hl = NULL;
+            needsRedraw = true;
+            ++editorInfo.generation;
+        }
+
+        prevOld = line->hlOpenComment;
+        prevNew = states[i];
+        line->hlOpenComment = states[i];
+        line->hlExact = true;
+    }
+    editorInfo.hlFrontier = count;
+    editorInfo.hlResume = false;
+    editorInfo.brDirty = true;
+
+    for (int i = 0; i < n; ++i) {
+        free(chunks[i].raw);
+        free(chunks[i].scratch);
+    }
+    free(states);
+}
+
+//Writes the buffer to a file with its highlighting as terminal colors. Once every line's state is known each chunk
+//colors its own lines into its own buffer, and the buffers are written out in order, a round of chunks at a time.
+void eExport(char *path) {
+    if (editorInfo.syntax == NULL || editorInfo.syntax->lex == NULL) {
+        eSetError("No syntax to export with");
+        return;
+    }
+    eHighlightParallel();
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        eSetError("Can't open '%s': %s", path, strerror(errno));
+        return;
+    }
+
+    int n = eLoadThreads(editorInfo.linecount, HL_MIN_CHUNK);
+    ehlchunk chunks[LOAD_MAX_THREADS];
+    abuf out[LOAD_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    memset(out, 0, sizeof(out));
+
+    int count = editorInfo.linecount;
+    int err = 0;
+    for (int from = 0; from < count && err == 0; from += n * HL_MIN_CHUNK) {
+        int used = 0;
+        for (int i = 0; i < n && from + i * HL_MIN_CHUNK < count; ++i) {
+            ehlchunk *c = &chunks[used++];
+            c->lex = editorInfo.syntax->lex;
+            c->start = from + i * HL_MIN_CHUNK;
+            c->end = c->start + HL_MIN_CHUNK < count ? c->start + HL_MIN_CHUNK : count;
+            c->entry = c->start > 0 ? editorInfo.line[c->start - 1].hlOpenComment : LexInCode;
+            c->out = &out[i];
+            out[i].len = 0;
+        }
+
+        eLoadRun(eHighlightChunk, chunks, sizeof(ehlchunk), used);
+        for (int i = 0; i < used && err == 0; ++i) {
+            if (fwrite(out[i].b, 1, out[i].len, fp) != (size_t)out[i].len) {
+                err = errno;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        free(chunks[i].raw);
+        free(chunks[i].scratch);
+        abFree(&out[i]);
+    }
+
+    //fclose only reports what went wrong flushing the last of it, so earlier writes are checked as they go.
+    if (fclose(fp) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        eSetError("Can't write '%s': %s", path, strerror(err));
+        return;
+    }
+    eSetStatus("Exported %d lines to %s", editorInfo.linecount, path);
+}
+
+//Must be called before changing a line's data in place.
+void eLineOwn(eline *line) {
+    eLineTouch(line);
+    eLineCopyOut(line);
+    line->modified = true;
+}
+
+void eLineFreeData(eline *line) {
+    if (line->zblock) {
+        eZBlockRelease(line->zblock);
+        line->zblock = NULL;
+    } else if (eLineInArena(line)) {
+        eArenaRelease();
+    } else if (eLineShared(line)) {
+        eSaveOrphan(line->data);
+    } else {
+        free(line->data);
+    }
+
+    line->data = NULL;
+}
+
+bool eLineCold(int idx, int lo, int hi) {
+    eline *line = &editorInfo.line[idx];
+    return line->zblock == NULL && !line->modified && !line->stale && (idx < lo || idx > hi) && idx != editorInfo.cy;
+}
+
+//Compresses the lines [start, end) into one block and drops their data, rendering and highlighting.
+void eCompressLines(int start, int end) {
+    static char *raw = NULL;
+    static unsigned char *z = NULL;
+    static int cap = 0;
+
+    int rawlen = 0;
+    for (int i = start; i < end; ++i) {
+        rawlen += editorInfo.line[i].size + 1;
+    }
+
+    if (rawlen + rawlen / 255 + 16 > cap) {
+        cap = rawlen + rawlen / 255 + 16;
+        raw = (char*)realloc(raw, cap);
+        z = (unsigned char*)realloc(z, cap);
+    }
+
+    int off = 0;
+    for (int i = start; i < end; ++i) {
+        eline *line = &editorInfo.line[i];
+        memcpy(&raw[off], line->data, line->size);
+        raw[off + line->size] = '\0';
+        off += line->size + 1;
+    }
+
+    int zlen = eLZCompress((unsigned char*)raw, rawlen, z);
+    ezblock *b = (ezblock*)malloc(sizeof(ezblock) + zlen);
+    b->refs = end - start;
+    b->rawlen = rawlen;
+    b->zlen = zlen;
+    memcpy(eZBlockData(b), z, zlen);
+
+    off = 0;
+    for (int i = start; i < end; ++i) {
+        eline *line = &editorInfo.line[i];
+        eLineFreeData(line);
+        free(line->rdata);
+        free(line->hl);
+        line->rdata = NULL;
+        line->hl = NULL;
+        line->zblock = b;
+        line->zoff = off;
+        off += line->size + 1;
+    }
+}
+
+//Compresses runs of unmodified lines away from the view while idle. A new pass starts once enough lines have been
+//decompressed again. Returns true if there's more to do.
+bool eCompressIdle(long long deadline) {
+    if (!editorInfo.compress || view.active) {
+        return false;
+    }
+
+    if (editorInfo.zNext >= editorInfo.linecount) {
+        if (editorInfo.zTouched < ZBLOCK_MAX_LINES) {
+            return false;
+        }
+
+        editorInfo.zNext = 0;
+        editorInfo.zTouched = 0;
+    }
+
+    int lo = editorInfo.yoffset - editorInfo.h * 2;
+    int hi = editorInfo.yoffset + editorInfo.h * 3;
+
+    while (editorInfo.zNext < editorInfo.linecount) {
+        int start = editorInfo.zNext;
+        int end = start;
+        int rawlen = 0;
+        while (end < editorInfo.linecount && end - start < ZBLOCK_MAX_LINES && rawlen < ZBLOCK_SIZE && eLineCold(end, lo, hi)) {
+            rawlen += editorInfo.line[end].size + 1;
+            ++end;
+        }
+
+        if (end > start) {
+            eCompressLines(start, end);
+            editorInfo.zNext = end;
+        } else {
+            editorInfo.zNext = start + 1;
+        }
+
+        if (eTimeUs() > deadline) {
+            break;
+        }
+    }
+
+    //Once only the lines around the view are left in the arena, copy them out so it can go.
+    if (editorInfo.zNext >= editorInfo.linecount && editorInfo.arenaRefs > 0 && editorInfo.arenaRefs <= hi - lo + 1) {
+        for (int i = 0; i < editorInfo.linecount && editorInfo.arena; ++i) {
+            if (editorInfo.line[i].zblock == NULL && eLineInArena(&editorInfo.line[i])) {
+                eLineCopyOut(&editorInfo.line[i]);
+            }
+        }
+    }
+
+    return editorInfo.zNext < editorInfo.linecount;
+}
+
+void eUndoClear() {
+    eundo *u = &editorInfo.undo;
+    free(u->recs);
+    free(u->text);
+
+    long long limit = u->limit;
+    memset(u, 0, sizeof(eundo));
+    u->limit = limit;
+}
+
+//Drops the oldest steps once the history goes over its limit, down to three quarters of it so this doesn't run on
+//every edit. The step being recorded is never dropped.
+void eUndoTrim() {
+    eundo *u = &editorInfo.undo;
+    long long size = u->textLen + (long long)u->total * sizeof(eundorec);
+    if (size <= u->limit) {
+        return;
+    }
+
+    int drop = 0;
+    while (drop < u->count && size > u->limit / 4 * 3 && u->recs[drop].group != u->group) {
+        int g = u->recs[drop].group;
+        while (drop < u->count && u->recs[drop].group == g) {
+            size -= u->recs[drop].len + sizeof(eundorec);
+            ++drop;
+        }
+    }
+
+    if (drop == 0) {
+        return;
+    }
+
+    long long shift = drop < u->total ? u->recs[drop].off : u->textLen;
+    memmove(u->text, u->text + shift, u->textLen - shift);
+    u->textLen -= shift;
+    memmove(u->recs, u->recs + drop, sizeof(eundorec) * (u->total - drop));
+    u->count -= drop;
+    u->total -= drop;
+    for (int i = 0; i < u->total; ++i) {
+        u->recs[i].off -= shift;
+    }
+
+    //The saved state might have been one of the dropped ones.
+    u->savedCount = u->savedCount >= drop ? u->savedCount - drop : -1;
+}
+
+void eUndoText(const char *text, int len) {
+    eundo *u = &editorInfo.undo;
+    if (u->textLen + len > u->textCap) {
+        u->textCap = u->textLen + len > u->textCap * 2 ? u->textLen + len : u->textCap * 2;
+        u->text = (char*)realloc(u->text, u->textCap);
+    }
+
+    if (len > 0) {
+        memcpy(&u->text[u->textLen], text, len);
+    }
+    u->textLen += len;
+}
+
+//Drops whatever could have been redone, since a new edit is about to be recorded.
+void eUndoCut() {
+    eundo *u = &editorInfo.undo;
+    //The saved state was on the branch being dropped, so nothing left in the log can get back to it.
+    if (u->savedCount > u->count) {
+        u->savedCount = -1;
+    }
+    if (u->total > u->count) {
+        u->total = u->count;
+        u->textLen = u->count > 0 ? u->recs[u->count - 1].off + u->recs[u->count - 1].len : 0;
+    }
+}
+
+//Starts a fresh record at the end of the log. Its text is whatever gets appended with eUndoText after this.
+eundorec *eUndoPush(char type, int line, int col) {
+    eundo *u = &editorInfo.undo;
+    if (!u->open) {
+        ++u->group;
+        u->open = true;
+    }
+
+    if (u->count == u->cap) {
+        u->cap = u->cap ? u->cap * 2 : 256;
+        u->recs = (eundorec*)realloc(u->recs, sizeof(eundorec) * u->cap);
+    }
+
+    eundorec *r = &u->recs[u->count++];
+    r->type = type;
+    r->group = u->group;
+    r->line = line;
+    r->col = col;
+    r->count = 0;
+    r->off = u->textLen;
+    r->len = 0;
+    u->total = u->count;
+    return r;
+}
+
+//Records an edit so it can be undone. Runs of typing and forward deletes on a line, and runs of line inserts and
+//deletes, are merged into the record before them.
+void eUndoRecord(char type, int line, int col, const char *text, int len) {
+    eundo *u = &editorInfo.undo;
+    if (u->suspend > 0) {
+        return;
+    }
+
+    eUndoCut();
+    bool lines = type == UndoInsLines || type == UndoDelLines;
+    eundorec *last = u->count > 0 ? &u->recs[u->count - 1] : NULL;
+    if (u->open && last && last->type == type && last->group == u->group && last->line + (type == UndoInsLines ? last->count : 0) == line) {
+        bool merge = false;
+        if (type == UndoInsText) {
+            merge = col == last->col + last->len;
+        } else if (type == UndoDelText) {
+            merge = col == last->col;
+        } else {
+            merge = true;
+        }
+
+        if (merge) {
+            eUndoText(text, len);
+            last->len += len;
+            if (lines) {
+                eUndoText("\n", 1);
+                ++last->len;
+                ++last->count;
+            }
+            return;
+        }
+    }
+
+    eundorec *r = eUndoPush(type, line, col);
+    r->count = lines ? 1 : 0;
+    r->len = len + lines;
+    eUndoText(text, len);
+    if (lines) {
+        eUndoText("\n", 1);
+    }
+
+    eUndoTrim();
+}
+
+//Records a whole block of lines inserted or deleted at once. The text already ends every line with a newline.
+void eUndoRecordLines(char type, int line, const char *text, int len, int count) {
+    if (editorInfo.undo.suspend > 0 || count <= 0) {
+        return;
+    }
+
+    eUndoCut();
+    eundorec *r = eUndoPush(type, line, 0);
+    r->count = count;
+    r->len = len;
+    eUndoText(text, len);
+
+    eUndoTrim();
+}
+
+void eInsertLine(int idx, char *line, size_t len) {
+    if (idx < 0 || idx > editorInfo.linecount) {
+        return;
+    }
+
+    if (editorInfo.linecount == editorInfo.linecap) {
+        editorInfo.linecap = editorInfo.linecap ? editorInfo.linecap * 2 : 16;
+        editorInfo.line = (eline*)realloc(editorInfo.line, sizeof(eline) * editorInfo.linecap);
+    }
+    memmove(&editorInfo.line[idx + 1], &editorInfo.line[idx], sizeof(eline) * (editorInfo.linecount - idx));
+    for (int i = idx + 1; i <= editorInfo.linecount; ++i) {
+        eline *l = &editorInfo.line[i];
+        ++l->idx;
+        if (l->uid >= 0) {
+            editorInfo.trigram->uidIdx[l->uid] = l->idx;
+        }
+    }
+    eTxnShift(idx, 0, 1);
+
+    editorInfo.line[idx].idx = idx;
+    editorInfo.line[idx].uid = -1;
+    editorInfo.line[idx].cowSeq = editorInfo.snapshotSeq;
+    editorInfo.line[idx].modified = true;
+    editorInfo.line[idx].stale = false;
+    editorInfo.line[idx].zblock = NULL;
+    editorInfo.line[idx].zoff = 0;
+    eTrigramInsertLine(idx);
+
+    editorInfo.line[idx].size = len;
+    editorInfo.line[idx].data = (char*)malloc(len + 1);
+    memcpy(editorInfo.line[idx].data, line, len);
+    editorInfo.line[idx].data[len] = '\0';
+
+    editorInfo.line[idx].rsize = 0;
+    editorInfo.line[idx].rdata = NULL;
+    editorInfo.line[idx].hl = NULL;
+    editorInfo.line[idx].hlOpenComment = 0;
+    editorInfo.line[idx].hlExact = false;
+    editorInfo.line[idx].br = (ebracket){0, 0};
+    ++editorInfo.linecount;
+    eHighlightRewind(idx, 0, 1);
+    eUpdateLine(&editorInfo.line[idx]);
+
+    ++editorInfo.dirty;
+    eUndoRecord(UndoInsLines, idx, 0, line, len);
+
+    editorInfo.maxLineLen = getNumDigits(editorInfo.linecount);
+}
+
+void eInsertNewLine() {
+    if (editorInfo.cy < editorInfo.linecount) {
+        eLineTouch(&editorInfo.line[editorInfo.cy]);
+    }
+
+    if (editorInfo.cx == 0) {
+        eInsertLine(editorInfo.cy, NULL, 0);
+    } else {
+        eline *line = &editorInfo.line[editorInfo.cy];
+        eInsertLine(editorInfo.cy + 1, &line->data[editorInfo.cx], line->size - editorInfo.cx);
+        line = &editorInfo.line[editorInfo.cy];
+        eLineDeleteRange(line, editorInfo.cx, line->size - editorInfo.cx);
+    }
+
+    ++editorInfo.cy;
+    editorInfo.cx = 0;
+
+    int spaces = 0;
+    int tabs = 0;
+    char *str = editorInfo.line[editorInfo.cy - 1].data;
+    for (int i = 0; i < editorInfo.line[editorInfo.cy - 1].size; ++i) {
+        if (str[i] == ' ') {
+            ++spaces;
+        } else if (str[i] == '\t') {
+            ++tabs;
+        } else {
+            break;
+        }
+    }
+
+    int oldcx = editorInfo.cx;
+    editorInfo.cx = 0;
+
+    int indent = 0;
+    if (spaces % TAB_SIZE == 0) {
+        indent += spaces / TAB_SIZE;
+    } else {
+        for (int i = 0; i < spaces; ++i) {
+            eInsertChar(' ');
+        }
+    }
+    indent += tabs;
+
+    for (int i = 0; i < indent; ++i) {
+        eInsertTab();
+    }
+    editorInfo.cx = oldcx + spaces + tabs;
+}
+
+void eFreeLine(eline *line) {
+    free(line->rdata);
+    eLineFreeData(line);
+    free(line->hl);
+}
+
+void eDeleteLine(int idx) {
+    if (idx < 0 || idx >= editorInfo.linecount) {
+        return;
+    }
+
+    eUndoRecord(UndoDelLines, idx, 0, eLineDataTemp(&editorInfo.line[idx]), editorInfo.line[idx].size);
+    eTrigramDeleteLine(idx);
+    eTxnShift(idx, 1, 0);
+    eFreeLine(&editorInfo.line[idx]);
+    memmove(&editorInfo.line[idx], &editorInfo.line[idx + 1], sizeof(eline) * (editorInfo.linecount - idx - 1));
+    for (int i = idx; i < editorInfo.linecount - 1; ++i) {
+        eline *l = &editorInfo.line[i];
+        --l->idx;
+        if (l->uid >= 0) {
+            editorInfo.trigram->uidIdx[l->uid] = l->idx;
+        }
+    }
+    --editorInfo.linecount;
+    eHighlightRewind(idx, 1, 0);
+    ++editorInfo.dirty;
+}
+
+//Replaces the lines [at, at + del) with insCount lines the caller has set up, moving the rest of the file only once.
+//Doesn't touch dirty or highlighting.
+void eSpliceLines(int at, int del, eline *ins, int insCount) {
+    etrigram *t = editorInfo.trigram;
+    for (int i = at; i < at + del; ++i) {
+        eTrigramRetire(&editorInfo.line[i]);
+        eFreeLine(&editorInfo.line[i]);
+    }
+    eTxnShift(at, del, insCount);
+
+    int count = editorInfo.linecount - del + insCount;
+    if (count > editorInfo.linecap) {
+        editorInfo.linecap = count > editorInfo.linecap * 2 ? count : editorInfo.linecap * 2;
+        editorInfo.line = (eline*)realloc(editorInfo.line, sizeof(eline) * editorInfo.linecap);
+    }
+
+    memmove(&editorInfo.line[at + insCount], &editorInfo.line[at + del], sizeof(eline) * (editorInfo.linecount - at - del));
+    if (insCount > 0) {
+        memcpy(&editorInfo.line[at], ins, sizeof(eline) * insCount);
+    }
+    editorInfo.linecount = count;
+
+    for (int i = at; i < count; ++i) {
+        eline *l = &editorInfo.line[i];
+        l->idx = i;
+        if (l->uid >= 0) {
+            t->uidIdx[l->uid] = i;
+        }
+    }
+
+    //The new lines get indexed now if the indexer has already gone past them, or later if it hasn't.
+    if (t != NULL) {
+        if (t->next >= at + del) {
+            t->next += insCount - del;
+            for (int i = at; i < at + insCount; ++i) {
+                eTrigramAddLine(&editorInfo.line[i]);
+            }
+        } else if (t->next > at) {
+            t->next = at;
+        }
+        ++t->gen;
+    }
+
+    eHighlightRewind(at, del, insCount);
+    editorInfo.maxLineLen = getNumDigits(editorInfo.linecount);
+}
+
+void eLineInsertString(eline *line, int idx, const char *s, int len) {
+    if (idx < 0 || idx > line->size) {
+        idx = line->size;
+    }
+
+    eLineOwn(line);
+    eUndoRecord(UndoInsText, line->idx, idx, s, len);
+    line->data = (char*)realloc(line->data, line->size + len + 1);
+    memmove(&line->data[idx + len], &line->data[idx], line->size - idx + 1);
+    memcpy(&line->data[idx], s, len);
+    line->size += len;
+    eUpdateLine(line);
+    ++editorInfo.dirty;
+}
+
+void eLineDeleteRange(eline *line, int idx, int len) {
+    if (idx < 0 || idx >= line->size) {
+        return;
+    }
+
+    if (idx + len > line->size) {
+        len = line->size - idx;
+    }
+    if (len <= 0) {
+        return;
+    }
+
+    eLineOwn(line);
+    eUndoRecord(UndoDelText, line->idx, idx, &line->data[idx], len);
+    memmove(&line->data[idx], &line->data[idx + len], line->size - idx - len + 1);
+    line->size -= len;
+    eUpdateLine(line);
+    ++editorInfo.dirty;
+}
+
+void eLineInsertChar(eline *line, int idx, int c) {
+    char ch = (char)c;
+    eLineInsertString(line, idx, &ch, 1);
+}
+
+void eLineDeleteChar(eline *line, int idx) {
+    eLineDeleteRange(line, idx, 1);
+}
+
+void eLineAppendString(eline *line, char *s, size_t len) {
+    eLineInsertString(line, line->size, s, (int)len);
+}
+
+//Inserts count lines from text, each ending in a newline, before idx with a single splice.
+void eInsertLinesText(int idx, const char *text, int textLen, int count) {
+    if (idx < 0 || idx > editorInfo.linecount || count <= 0) {
+        return;
+    }
+
+    //Lines can hold NULs, so only the length says where the text stops.
+    const char *start = text;
+    const char *end = text + textLen;
+    eline *ins = (eline*)malloc(sizeof(eline) * count);
+    for (int i = 0; i < count; ++i) {
+        const char *nl = (const char*)memchr(text, '\n', end - text);
+        if (nl == NULL) {
+            nl = end;
+        }
+        int len = (int)(nl - text);
+        eline *l = &ins[i];
+        memset(l, 0, sizeof(eline));
+        l->uid = -1;
+        l->cowSeq = editorInfo.snapshotSeq;
+        l->modified = true;
+        l->size = len;
+        l->data = (char*)malloc(len + 1);
+        memcpy(l->data, text, len);
+        l->data[len] = '\0';
+        eRenderLine(l);
+        text = nl < end ? nl + 1 : end;
+    }
+
+    eUndoRecordLines(UndoInsLines, idx, start, (int)(text - start), count);
+    eSpliceLines(idx, 0, ins, count);
+    eUpdateSyntaxRange(idx, idx + count + 1);
+    ++editorInfo.dirty;
+    free(ins);
+}
+
+//Appends the lines [at, at + count) to buf, each followed by a newline. Returns the new length.
+int eLinesText(int at, int count, char **buf, int len, int *cap) {
+    for (int i = at; i < at + count; ++i) {
+        eline *l = &editorInfo.line[i];
+        if (len + l->size + 1 > *cap) {
+            *cap = len + l->size + 1 > *cap * 2 ? len + l->size + 1 : *cap * 2;
+            *buf = (char*)realloc(*buf, *cap);
+        }
+
+        memcpy(*buf + len, eLineDataTemp(l), l->size);
+        len += l->size;
+        (*buf)[len++] = '\n';
+    }
+
+    return len;
+}
+
+//Deletes the lines [at, at + count) with a single splice. The undo log gets them as one record.
+void eDeleteLines(int at, int count) {
+    if (at < 0 || at >= editorInfo.linecount || count <= 0) {
+        return;
+    }
+    if (at + count > editorInfo.linecount) {
+        count = editorInfo.linecount - at;
+    }
+
+    eundo *u = &editorInfo.undo;
+    if (u->suspend == 0) {
+        eUndoCut();
+        eundorec *r = eUndoPush(UndoDelLines, at, 0);
+        for (int i = at; i < at + count; ++i) {
+            eline *l = &editorInfo.line[i];
+            eUndoText(eLineDataTemp(l), l->size);
+            eUndoText("\n", 1);
+        }
+        r->count = count;
+        r->len = (int)(u->textLen - r->off);
+        eUndoTrim();
+    }
+
+    eSpliceLines(at, count, NULL, 0);
+    if (at < editorInfo.linecount) {
+        eUpdateSyntax(&editorInfo.line[at]);
+    }
+    ++editorInfo.dirty;
+}
+
+//Rotates the lines [at, at + count) so the one at at + by comes first, moving only the line records. Lines inside
+//either part keep the line above them, so only the three that get a new one are lexed again.
+void eRotateLines(int at, int count, int by) {
+    int tail = count - by;
+    if (by <= 0 || tail <= 0) {
+        return;
+    }
+
+    eline *l = editorInfo.line;
+    if (by <= tail) {
+        eline *tmp = (eline*)malloc(sizeof(eline) * by);
+        memcpy(tmp, &l[at], sizeof(eline) * by);
+        memmove(&l[at], &l[at + by], sizeof(eline) * tail);
+        memcpy(&l[at + tail], tmp, sizeof(eline) * by);
+        free(tmp);
+    } else {
+        eline *tmp = (eline*)malloc(sizeof(eline) * tail);
+        memcpy(tmp, &l[at + by], sizeof(eline) * tail);
+        memmove(&l[at + tail], &l[at], sizeof(eline) * by);
+        memcpy(&l[at], tmp, sizeof(eline) * tail);
+        free(tmp);
+    }
+
+    etrigram *t = editorInfo.trigram;
+    for (int i = at; i < at + count; ++i) {
+        l[i].idx = i;
+        if (l[i].uid >= 0) {
+            t->uidIdx[l[i].uid] = i;
+        }
+    }
+    //Indexed and unindexed lines got mixed up, so the indexer goes back over them.
+    if (t != NULL) {
+        if (t->next > at && t->next < at + count) {
+            t->next = at;
+        }
+        ++t->gen;
+    }
+
+    ++editorInfo.generation;
+    for (int i = 0; i < txn.count; ++i) {
+        int idx = txn.lines[i];
+        if (idx >= at && idx < at + count) {
+            txn.lines[i] = idx < at + by ? idx + tail : idx - by;
+        }
+    }
+    if (editorInfo.cursorCount > 0) {
+        for (int i = 0; i < editorInfo.cursorCount; ++i) {
+            int cy = editorInfo.cursors[i].cy;
+            if (cy >= at && cy < at + count) {
+                editorInfo.cursors[i].cy = cy < at + by ? cy + tail : cy - by;
+            }
+        }
+        eCursorSort();
+    }
+
+    eundo *u = &editorInfo.undo;
+    if (u->suspend == 0) {
+        eUndoCut();
+        eundorec *r = eUndoPush(UndoMoveLines, at, by);
+        r->count = count;
+        eUndoTrim();
+    }
+
+    int seams[3] = {at, at + tail, at + count};
+    for (int i = 0; i < 3; ++i) {
+        if (seams[i] < editorInfo.linecount) {
+            l[seams[i]].hlExact = false;
+        }
+    }
+    if (at < editorInfo.hlFrontier) {
+        editorInfo.hlFrontier = at;
+    }
+    editorInfo.hlResume = false;
+    eBracketSplice(at, count, count);
+    for (int i = 0; i < 3; ++i) {
+        if (seams[i] < editorInfo.linecount) {
+            eUpdateSyntax(&l[seams[i]]);
+        }
+    }
+    ++editorInfo.dirty;
+}
+
+//Applies a record, or its inverse if reverse is set.
+void eUndoApply(eundorec *r, bool reverse) {
+    char *text = &editorInfo.undo.text[r->off];
+    bool insert = (r->type == UndoInsText || r->type == UndoInsLines) != reverse;
+
+    if (r->type == UndoMoveLines) {
+        eRotateLines(r->line, r->count, reverse ? r->count - r->col : r->col);
+    } else if (r->type == UndoInsText || r->type == UndoDelText) {
+        eline *line = &editorInfo.line[r->line];
+        if (insert) {
+            eLineInsertString(line, r->col, text, r->len);
+        } else {
+            eLineDeleteRange(line, r->col, r->len);
+        }
+    } else if (insert) {
+        eInsertLinesText(r->line, text, r->len, r->count);
+    } else {
+        eDeleteLines(r->line, r->count);
+    }
+
+    editorInfo.cy = r->line < editorInfo.linecount ? r->line : editorInfo.linecount;
+    editorInfo.cx = r->type == UndoInsText || r->type == UndoDelText ? r->col : 0;
+}
+
+void eUndoDone() {
+    eundo *u = &editorInfo.undo;
+    u->open = false;
+    editorInfo.dirty = u->count == u->savedCount ? 0 : editorInfo.dirty + 1;
+
+    if (editorInfo.cy < editorInfo.linecount && editorInfo.cx > editorInfo.line[editorInfo.cy].size) {
+        editorInfo.cx = editorInfo.line[editorInfo.cy].size;
+    }
+    editorInfo.tx = editorInfo.cx;
+}
+
+void eUndo() {
+    eundo *u = &editorInfo.undo;
+    if (u->count == 0) {
+        eSetStatus("Already at oldest change");
+        return;
+    }
+
+    int group = u->recs[u->count - 1].group;
+    ++u->suspend;
+    while (u->count > 0 && u->recs[u->count - 1].group == group) {
+        eUndoApply(&u->recs[--u->count], true);
+    }
+    --u->suspend;
+    eUndoDone();
+}
+
+void eRedo() {
+    eundo *u = &editorInfo.undo;
+    if (u->count == u->total) {
+        eSetStatus("Already at newest change");
+        return;
+    }
+
+    int group = u->recs[u->count].group;
+    ++u->suspend;
+    while (u->count < u->total && u->recs[u->count].group == group) {
+        eUndoApply(&u->recs[u->count++], false);
+    }
+    --u->suspend;
+    eUndoDone();
+}
+
+//Typing and deleting runs in edit mode undo as one step. Any other key starts a new one.
+void eUndoBreak(int k) {
+    static int lastKind = 0;
+
+    int kind = 0;
+    if (editorInfo.mode == EDT) {
+        if (k == vk_backspace || k == CTRL_KEY('h') || k == vk_delete) {
+            kind = 2;
+        } else if (k == vk_enter || k == vk_tab || (k >= ' ' && k < 256)) {
+            kind = 1;
+        }
+    }
+
+    if (kind == 0 || kind != lastKind) {
+        editorInfo.undo.open = false;
+    }
+    lastKind = kind;
+}
+
+void eInsertChar(int c) {
+    if (c != '\t' && iscntrl(c)) {
+        return;
+    }
+
+    if (editorInfo.cy == editorInfo.linecount) {
+        eInsertLine(editorInfo.linecount, NULL, 0);
+    }
+
+    eLineInsertChar(&editorInfo.line[editorInfo.cy], editorInfo.cx, c);
+    ++editorInfo.cx;
+}
+
+bool eUseTrueTab() {
+    char *fnt = editorInfo.filenameTrunc;
+    return editorInfo.useTrueTab || (fnt && (strcmp(fnt, "Makefile") == 0 || strcmp(fnt, "makefile") == 0));
+}
+
+void eInsertTab() {
+    if (eUseTrueTab()) {
+        eInsertChar('\t');
+    } else {
+        for (int i = 0; i < TAB_SIZE; ++i) {
+            eInsertChar(' ');
+        }
+    }
+}
+
+void eDeleteChar() {
+    if (editorInfo.cy == editorInfo.linecount || (editorInfo.cx == 0 && editorInfo.cy == 0)) {
+        return;
+    }
+
+    eline *line = &editorInfo.line[editorInfo.cy];
+    if (editorInfo.cx > 0) {
+        eLineDeleteChar(line, editorInfo.cx - 1);
+        --editorInfo.cx;
+    } else {
+        eLineTouch(line);
+        editorInfo.cx = editorInfo.line[editorInfo.cy - 1].size;
+        eLineAppendString(&editorInfo.line[editorInfo.cy - 1], line->data, line->size);
+        eDeleteLine(editorInfo.cy);
+        --editorInfo.cy;
+    }
+    
+    editorInfo.tx = editorInfo.cx;
+}
+
+void cls() {
+    eRenderFlush();
+    write(STDOUT_FILENO, "\x1b]1337;CursorShape=0\x07", 21); //set cursor to a block, iTerm2 specific
+    write(STDOUT_FILENO, "\x1b[m", 3);
+    write(STDOUT_FILENO, "\x1b[2J", 4); //cls
+    write(STDOUT_FILENO, "\x1b[H", 3); //move cursor
+}
+
+void die(const char *s) {
+    cls();
+
+    perror(s);
+    exit(1);
+}
+
+void quit() {
+    eSaveWait();
+
+    //A server only lets go of the client. Hanging up is noticed by the input thread like any other client leaving.
+    if (server.listen != -1) {
+        shutdown(STDIN_FILENO, SHUT_RDWR);
+        return;
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+void disableRawMode() {
+    eRenderFlush();
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editorInfo.origTermios) == -1) {
+        die("tcsetattr");
+    }
+
+    //write(STDOUT_FILENO, "\x1b[?9l", 5)
+    write(STDOUT_FILENO, "\x1b[?47l", 6);
+
+    cls();
+    if (clientNotice[0]) {
+        fprintf(stderr, "shabi: %s\n", clientNotice);
+    }
+}
+
+void enableRawMode() {
+    if (tcgetattr(STDIN_FILENO, &editorInfo.origTermios) == -1) {
+        die("tcgetattr");
+    }
+    atexit(disableRawMode);
+
+    struct termios raw = editorInfo.origTermios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        die("tcsetattr");
+    }
+
+    write(STDOUT_FILENO, "\x1b[?47h", 6);
+}
+
+void eSetStatus(const char *fmt, ...) {
+    if (fmt == NULL) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(editorInfo.statusmsg, sizeof(editorInfo.statusmsg), fmt, args);
+    va_end(args);
+    editorInfo.statusmsgTime = time(NULL);
+}
+
+void eSetError(const char *fmt, ...) {
+    if (fmt == NULL) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(editorInfo.statusmsg, sizeof(editorInfo.statusmsg), fmt, args);
+    va_end(args);
+    editorInfo.statusmsgTime = time(NULL);
+    editorInfo.statuserror = true;
+
+    //Like vim, a macro stops at the first thing that goes wrong.
+    if (replay.depth > 0) {
+        replay.failed = true;
+    }
+}
+
+char *ePrompt(const char *prompt, void (*callback)(char *, int)) {
+    if (prompt == NULL) {
+        return NULL;
+    }
+    
+    editorInfo.statuserror = false;
+    firstMessage = false;
+
+    size_t bufsize = 128;
+    char *buf = (char*)malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (true) {
+        eSetStatus(prompt, buf);
+        ecls();
+
+        int k = eReadKey();
+        if (k == vk_delete || k == CTRL_KEY('h') || k == vk_backspace) {
+            if (buflen != 0) {
+                buf[--buflen] = '\0';
+            }
+        } else if (k == vk_escape) {
+            eSetStatus("");
+            if (callback) {
+                callback(buf, k);
+            }
+            free(buf);
+
+            return NULL;
+        } else if (k == vk_enter) {
+            if (buflen != 0) {
+                eSetStatus("");
+                if (callback) {
+                    callback(buf, k);
+                }
+                return buf;
+            }
+        } else if (!iscntrl(k) && k < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = (char*)realloc(buf, bufsize);
+            }
+
+            buf[buflen++] = (char)k;
+            buf[buflen] = '\0';
+        }
+
+        if (callback) {
+            callback(buf, k);
+        }
+    }
+}
+
+void eMove(int k) {
+    eline *line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
+
+    switch (k) {
+        case vk_left: {
+            if (editorInfo.cx != 0) {
+                --editorInfo.cx;
+            } else if (editorInfo.cy > 0) {
+                --editorInfo.cy;
+                editorInfo.cx = editorInfo.line[editorInfo.cy].size;
+            }
+            
+            editorInfo.tx = editorInfo.cx;
+        } break;
+
+        case vk_right: {
+            if (line && editorInfo.cx < line->size) {
+                ++editorInfo.cx;
+            } else if (line && editorInfo.cx == line->size) {
+                ++editorInfo.cy;
+                editorInfo.cx = 0;
+            }
+            
+            editorInfo.tx = editorInfo.cx;
+        } break;
+
+        case vk_up: {
+            if (editorInfo.cy != 0) {
+                --editorInfo.cy;
+            }
+        } break;
+
+        case vk_down: {
+            if (editorInfo.cy < editorInfo.linecount) {
+                ++editorInfo.cy;
+            }
+        } break;
+
+        default: break;
+    }
+
+    line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
+    int linelen = line ? line->size : 0;
+    
+    if (editorInfo.tx > editorInfo.cx) {
+        editorInfo.cx = editorInfo.tx;
+    }
+    
+    if (editorInfo.cx > linelen) {
+        editorInfo.cx = linelen;
+    }
+}
+
+//Decodes the key that starts with c, reading the rest of an escape sequence if there is one.
+int eDecodeKey(char c) {
+    if (c == '\x1b') {
+        char seq[3];
+
+        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+            return '\x1b';
+        }
+
+        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+            return '\x1b';
+        }
+
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] < '9') {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                    return '\x1b';
+                }
+
+                //A client reports its terminal's new size the way xterm reports its own, ESC [ 8 ; rows ; cols t.
+                if (server.listen != -1 && seq[1] == '8' && seq[2] == ';') {
+                    int size[2] = {0, 0};
+                    int n = 0;
+                    char d;
+                    while (read(STDIN_FILENO, &d, 1) == 1 && d != 't') {
+                        if (d == ';' && n == 0) {
+                            n = 1;
+                        } else if (isdigit(d)) {
+                            size[n] = size[n] * 10 + d - '0';
+                        } else {
+                            return '\x1b';
+                        }
+                    }
+
+                    if (size[0] > 2 && size[1] > 0) {
+                        server.h = size[0];
+                        server.w = size[1];
+                        return vk_resize;
+                    }
+                    return '\x1b';
+                }
+
+                if (seq[2] == '~') {
+                    switch (seq[1]) {
+                        case '3': return vk_delete;
+                        case '5': return vk_pageup;
+                        case '6': return vk_pagedown;
+                        case '1':
+                        case '7': return vk_home;
+                        case '4':
+                        case '8': return vk_end;
+                    }
+                }
+            } else {
+                switch (seq[1]) {
+                    case 'A': return vk_up;
+                    case 'B': return vk_down;
+                    case 'C': return vk_right;
+                    case 'D': return vk_left;
+                    case 'H': return vk_home;
+                    case 'F': return vk_end;
+                }
+            }
+        } else if (seq[0] == 'O') {
+            switch (seq[1]) {
+                case 'H': return vk_home;
+                case 'F': return vk_end;
+            }
+        }
+
+        return '\x1b';
+    }
+
+    return c;
+}
+
+void eInputPush(einput *in, int k) {
+    //A full ring waits for the main thread to catch up rather than dropping keys.
+    unsigned int head = in->head;
+    while (head - __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE) == INPUT_RING) {
+        usleep(1000);
+    }
+
+    in->keys[head % INPUT_RING] = k;
+    __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+    if (write(in->wake[1], "k", 1) == -1 && errno != EAGAIN) {
+        die("write");
+    }
+}
+
+//Reads and decodes keys for as long as the editor runs, so a slow frame never holds up the terminal.
+void *eInputThread(void *arg) {
+    einput *in = (einput*)arg;
+
+    while (true) {
+        struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {server.listen, POLLIN, 0}};
+        if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+            die("poll");
+        }
+
+        //A server has one client at a time. A new one takes over, since the old one may well be a terminal that's
+        //gone without the server hearing about it yet. Hanging up leaves the read below to notice.
+        if (pfd[1].revents & POLLIN) {
+            eServerTakeover();
+        } else if (pfd[0].revents == 0) {
+            continue;
+        }
+
+        char c;
+        int nread = read(STDIN_FILENO, &c, 1);
+        if (server.listen != -1 && (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR))) {
+            //The client's gone. Nothing more is read until the main thread has taken the next one.
+            eInputPush(in, vk_detach);
+            char b;
+            while (read(server.attach[0], &b, 1) == -1 && errno == EINTR) {}
+            continue;
+        } else if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+            die("read");
+        } else if (nread != 1) {
+            continue;
+        }
+
+        eInputPush(in, eDecodeKey(c));
+    }
+
+    return NULL;
+}
+
+//Starts a thread that lives as long as the editor. Signals like SIGWINCH change the editor's state from the handler,
+//so they're blocked there to make sure they land on the main thread.
+void eStartThread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        die("pthread_create");
+    }
+}
+
+void eInputStart() {
+    if (pipe(input.wake) == -1) {
+        die("pipe");
+    }
+    fcntl(input.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(input.wake[1], F_SETFL, O_NONBLOCK);
+
+    eStartThread(&input.thread, eInputThread, &input);
+    input.active = true;
+}
+
+//Whether there are keys waiting that haven't been read yet.
+bool eInputPending() {
+    return __atomic_load_n(&input.head, __ATOMIC_ACQUIRE) != input.tail;
+}
+
+int eReadTermKey() {
+    static bool idleMore = false;
+    static long long lastDraw = 0;
+
+    while (true) {
+        if (eInputPending()) {
+            int k = input.keys[input.tail % INPUT_RING];
+            __atomic_store_n(&input.tail, input.tail + 1, __ATOMIC_RELEASE);
+            if (k == vk_detach) {
+                eServerDetach();
+                continue;
+            } else if (k == vk_resize) {
+                resizeWindow();
+                continue;
+            }
+            return k;
+        }
+
+        //Only block on input once there's no background work left, and even then wake up every so often for the
+        //checks that poll. A server without a client also waits for the next one here.
+        struct pollfd pfd[2] = {{input.wake[0], POLLIN, 0}, {server.attached ? -1 : server.listen, POLLIN, 0}};
+        int ready = poll(pfd, 2, idleMore ? 0 : 100);
+        if (ready == -1 && errno != EINTR) {
+            die("poll");
+        } else if (ready > 0 && (pfd[1].revents & POLLIN)) {
+            eServerAccept();
+            continue;
+        } else if (ready > 0) {
+            char drain[64];
+            ssize_t n;
+            do {
+                n = read(input.wake[0], drain, sizeof(drain));
+            } while (n == sizeof(drain));
+            continue;
+        }
+
+        idleMore = eIdle();
+
+        //While background work keeps going, only redraw every so often.
+        //Whatever changed in the background changed in the current buffer.
+        if (needsRedraw && (!idleMore || eTimeUs() - lastDraw >= IDLE_REDRAW_US)) {
+            needsRedraw = false;
+            ++editorInfo.generation;
+            lastDraw = eTimeUs();
+            ecls();
+        }
+    }
+}
+
+int eReadKey() {
+    if (replay.depth > 0 && !replay.failed) {
+        if (replay.pos == replay.len && replay.times > 1) {
+            replay.pos = 0;
+            --replay.times;
+        }
+        if (replay.pos < replay.len) {
+            return replay.keys[replay.pos++];
+        }
+    }
+
+    int k = eReadTermKey();
+    if (recording >= 0) {
+        emacro *m = &macros[recording];
+        if (m->len == m->cap) {
+            m->cap = m->cap ? m->cap * 2 : 64;
+            m->keys = (int*)realloc(m->keys, sizeof(int) * m->cap);
+        }
+        m->keys[m->len++] = k;
+    }
+
+    return k;
+}
+
+int cursorPosition(int *x, int *y) {
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+        return -1;
+    }
+
+    while (i < sizeof(buf) - 1) {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+            break;
+        }
+
+        if (buf[i] == 'R') {
+            break;
+        }
+
+        ++i;
+    }
+    buf[i] = '\0';
+
+    if (buf[0] != '\x1b' || buf[1] != '[') {
+        return -1;
+    }
+
+    if (sscanf(&buf[2], "%d;%d", y, x) != 2) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//Without TIOCGWINSZ the size comes from asking the terminal where the cursor ended up. The reply arrives on stdin, which
+//belongs to the input thread once it's running, so after that the size stays what it was.
+int windowSize(int *w, int *h) {
+    struct winsize ws;
+
+    if (server.listen != -1) {
+        *w = server.w;
+        *h = server.h;
+        return 0;
+    }
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        if (input.active) {
+            return -1;
+        }
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+            return -1;
+        }
+
+        return cursorPosition(w, h);
+    }
+
+    *w = ws.ws_col;
+    *h = ws.ws_row;
+
+    return 0;
+}
+
+//Writes all of the iovecs, picking up where a short write left off.
+bool eWritev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+//Streams the lines straight from their buffers into a temporary file next to filename, then renames it into place so a
+//failed write never leaves a truncated file behind. Returns the number of bytes written or -1 with errno set.
+long long eWriteFile(const char *filename, esaveline *lines, int count, long long *progress) {
+    char *target = realpath(filename, NULL);
+    if (target == NULL) {
+        target = strdup(filename);
+    }
+
+    int tmplen = (int)strlen(target) + 16;
+    char *tmp = (char*)malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.shabiXXXXXX", target);
+
+    long long total = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        struct stat st;
+        if (stat(target, &st) == 0) {
+            //Only root can hand the file back to its owner, but a group we're in still carries over.
+            if (fchown(fd, st.st_uid, st.st_gid) == -1 && fchown(fd, (uid_t)-1, st.st_gid) == -1) {
+                //Saving it as ourselves beats not saving it.
+            }
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0644 & ~mask);
+        }
+
+        struct iovec iov[SAVE_IOVECS];
+        int iovcnt = 0;
+        long long written = 0;
+        bool ok = true;
+
+        //Compressed lines get decompressed a block at a time into a buffer of our own.
+        ezblock *zblock = NULL;
+        char *zraw = NULL;
+
+        for (int i = 0; i < count && ok; ++i) {
+            char *data = lines[i].data;
+            if (lines[i].zblock) {
+                if (lines[i].zblock != zblock) {
+                    //The pending iovecs may still point into the previous block.
+                    if (iovcnt > 0) {
+                        ok = eWritev(fd, iov, iovcnt);
+                        iovcnt = 0;
+                    }
+
+                    zblock = lines[i].zblock;
+                    zraw = (char*)realloc(zraw, zblock->rawlen);
+                    ok = ok && eLZDecompress(eZBlockData(zblock), zblock->zlen, zraw, zblock->rawlen);
+                }
+
+                data = &zraw[lines[i].zoff];
+            }
+
+            iov[iovcnt].iov_base = data;
+            iov[iovcnt++].iov_len = lines[i].size;
+            iov[iovcnt].iov_base = "\n";
+            iov[iovcnt++].iov_len = 1;
+            written += lines[i].size + 1;
+
+            if (iovcnt + 2 > SAVE_IOVECS) {
+                ok = eWritev(fd, iov, iovcnt);
+                iovcnt = 0;
+                __atomic_store_n(progress, written, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (ok && iovcnt > 0) {
+            ok = eWritev(fd, iov, iovcnt);
+        }
+        free(zraw);
+
+        if (ok && fsync(fd) == 0 && close(fd) == 0) {
+            fd = -1;
+            if (rename(tmp, target) == 0) {
+                total = written;
+
+                //The new name is only on disk once the directory is.
+                char *slash = strrchr(target, '/');
+                char *dir = slash == NULL ? strdup(".") : slash == target ? strdup("/") : strndup(target, slash - target);
+                int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+                if (dirfd != -1) {
+                    fsync(dirfd);
+                    close(dirfd);
+                }
+                free(dir);
+            }
+        }
+
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (total == -1) {
+            unlink(tmp);
+        }
+        errno = err;
+    }
+
+    free(tmp);
+    free(target);
+
+    return total;
+}
+
+typedef struct eloadchunk {
+    int fd;
+    char *buf;
+    long long start;
+    long long end;
+    long long *newlines;
+    int count;
+    int cap;
+    long long prevNewline;
+    eline *lines;
+    int firstLine;
+    bool render;
+    bool ok;
+    unsigned long long *hashes;
+} eloadchunk;
+
+void eLoadNewline(eloadchunk *c, long long pos) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 4096;
+        c->newlines = (long long*)realloc(c->newlines, sizeof(long long) * c->cap);
+    }
+
+    c->newlines[c->count++] = pos;
+}
+
+void eLoadSplit(eloadchunk *c) {
+    char *p = c->buf + c->start;
+    char *end = c->buf + c->end;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        eLoadNewline(c, p - c->buf);
+        ++p;
+    }
+}
+
+//Reads a chunk of the file into the arena and records where its newlines are. With hashes set it also hashes each
+//LOAD_MIN_CHUNK block of it, while the data's still in cache.
+void *eLoadScan(void *arg) {
+    eloadchunk *c = (eloadchunk*)arg;
+
+    long long pos = c->start;
+    while (pos < c->end) {
+        ssize_t n = pread(c->fd, c->buf + pos, c->end - pos, pos);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+
+            c->ok = false;
+            return NULL;
+        }
+        pos += n;
+    }
+
+    if (c->hashes) {
+        for (long long off = c->start; off < c->end; off += LOAD_MIN_CHUNK) {
+            long long len = c->end - off < LOAD_MIN_CHUNK ? c->end - off : LOAD_MIN_CHUNK;
+            c->hashes[off / LOAD_MIN_CHUNK] = eHashData(c->buf + off, len);
+        }
+    }
+
+    eLoadSplit(c);
+    c->ok = true;
+    return NULL;
+}
+
+void eLoadInitLine(eline *line, int idx, char *buf, long long start, long long end, bool render) {
+    while (end > start && buf[end - 1] == '\r') {
+        --end;
+    }
+    buf[end] = '\0';
+
+    line->idx = idx;
+    line->size = (int)(end - start);
+    line->data = &buf[start];
+    line->rsize = 0;
+    line->rdata = NULL;
+    line->hl = NULL;
+    line->hlOpenComment = 0;
+    line->hlExact = false;
+    line->br = (ebracket){0, 0};
+    line->uid = -1;
+    line->cowSeq = editorInfo.snapshotSeq;
+    line->modified = false;
+    line->stale = false;
+    line->zblock = NULL;
+    line->zoff = 0;
+    if (render) {
+        eRenderLine(line);
+    }
+}
+
+//Builds the line records for every line that ends in this chunk.
+void *eLoadBuild(void *arg) {
+    eloadchunk *c = (eloadchunk*)arg;
+
+    long long lineStart = c->prevNewline + 1;
+    for (int i = 0; i < c->count; ++i) {
+        long long nl = c->newlines[i];
+        eLoadInitLine(&c->lines[c->firstLine + i], c->firstLine + i, c->buf, lineStart, nl, c->render);
+        lineStart = nl + 1;
+    }
+
+    return NULL;
+}
+
+//How many threads to split work between so that each gets at least minChunk of it, one per core at most.
+int eLoadThreads(long long work, long long minChunk) {
+    long long n = work / minChunk;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > cpus) {
+        n = cpus;
+    }
+    if (n > LOAD_MAX_THREADS) {
+        n = LOAD_MAX_THREADS;
+    }
+    return n < 1 ? 1 : (int)n;
+}
+
+//Runs fn on each of n chunks of the given size, the first on this thread and the rest on their own.
+void eLoadRun(void *(*fn)(void *), void *chunks, size_t size, int n) {
+    pthread_t threads[LOAD_MAX_THREADS];
+    bool started[LOAD_MAX_THREADS];
+
+    for (int i = 1; i < n; ++i) {
+        void *c = (char*)chunks + size * i;
+        started[i] = pthread_create(&threads[i], NULL, fn, c) == 0;
+        if (!started[i]) {
+            fn(c);
+        }
+    }
+
+    fn(chunks);
+
+    for (int i = 1; i < n; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+//Reads a whole file into one arena and splits it into lines. The file is cut into chunks that are read and scanned for
+//newlines on separate threads, then the line records are built in one allocation, again a chunk per thread.
+//Lines point straight into the arena and are only rendered if render is set. With an index the content's hash is
+//handed back in it. Returns NULL on error.
+eline *eLoadLines(int fd, long long size, char **arenaOut, int *countOut, bool render, eloadindex *index) {
+    char *buf = (char*)malloc(size + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    int n = eLoadThreads(size, LOAD_MIN_CHUNK);
+
+    //Chunks start on a block, so the blocks that get hashed are the same however many threads there are.
+    long long blocks = (size + LOAD_MIN_CHUNK - 1) / LOAD_MIN_CHUNK;
+    unsigned long long *hashes = index ? (unsigned long long*)calloc(blocks + 1, sizeof(unsigned long long)) : NULL;
+    eloadchunk chunks[LOAD_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int i = 0; i < n; ++i) {
+        chunks[i].fd = fd;
+        chunks[i].buf = buf;
+        chunks[i].start = size * i / n / LOAD_MIN_CHUNK * LOAD_MIN_CHUNK;
+        chunks[i].end = i + 1 < n ? size * (i + 1) / n / LOAD_MIN_CHUNK * LOAD_MIN_CHUNK : size;
+        chunks[i].render = render;
+        chunks[i].hashes = hashes;
+    }
+
+    eLoadRun(eLoadScan, chunks, sizeof(eloadchunk), n);
+
+    //The blocks were hashed before the lines get built, which cuts them out of the arena in place.
+    if (index) {
+        index->hash = eHashData((const char*)hashes, (long long)sizeof(unsigned long long) * blocks) ^ (unsigned long long)size;
+        free(hashes);
+    }
+
+    bool ok = true;
+    int count = 0;
+    long long prevNewline = -1;
+    for (int i = 0; i < n; ++i) {
+        ok = ok && chunks[i].ok;
+        chunks[i].firstLine = count;
+        chunks[i].prevNewline = prevNewline;
+        count += chunks[i].count;
+        if (chunks[i].count > 0) {
+            prevNewline = chunks[i].newlines[chunks[i].count - 1];
+        }
+    }
+
+    bool trailing = prevNewline < size - 1;
+    eline *lines = NULL;
+    if (ok) {
+        lines = (eline*)malloc(sizeof(eline) * (count + trailing + 1));
+        for (int i = 0; i < n; ++i) {
+            chunks[i].lines = lines;
+        }
+
+        eLoadRun(eLoadBuild, chunks, sizeof(eloadchunk), n);
+
+        //The last line doesn't have to end in a newline.
+        if (trailing) {
+            eLoadInitLine(&lines[count], count, buf, prevNewline + 1, size, render);
+            ++count;
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        free(chunks[i].newlines);
+    }
+
+    if (!ok) {
+        free(buf);
+        return NULL;
+    }
+
+    *arenaOut = buf;
+    *countOut = count;
+
+    return lines;
+}
+
+long long eStatMtime(struct stat *st) {
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+//A file's index is named after its real path.
+bool eIndexPath(char *filename, char *path) {
+    char full[PATH_MAX];
+    char *dir = eCacheDir();
+    if (dir == NULL || realpath(filename, full) == NULL) {
+        free(dir);
+        return false;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%016llx.idx", dir, eHashLine(full, (int)strlen(full)));
+    free(dir);
+    return true;
+}
+
+//Returns the file's index if there's one for its current size and mtime. Whether the content is the same is up to the
+//hash, once the file's been read.
+eindex *eIndexLoad(char *filename, struct stat *st) {
+    char path[PATH_MAX];
+    if (!eIndexPath(filename, path)) {
+        return NULL;
+    }
+
+    long long size;
+    eindex *index = (eindex*)eCacheRead(path, sizeof(eindex), &size);
+    if (index == NULL) {
+        return NULL;
+    }
+
+    bool ok = memcmp(index->magic, "SHIX", 4) == 0 &&
+              index->version == INDEX_VERSION && index->size == st->st_size && index->mtime == eStatMtime(st) &&
+              index->lines >= 0 &&
+              (long long)sizeof(eindex) + (long long)index->lines * (sizeof(unsigned short) + sizeof(ebracket)) == size;
+
+    if (!ok) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+//Puts the states and brackets from an index back on the lines, as long as the same lexer made them. Every line is
+//then exact and there's nothing left for the background pass.
+bool eIndexApply(eindex *index) {
+    elexer *lex = editorInfo.syntax ? editorInfo.syntax->lex : NULL;
+    if (index->lexHash != (lex ? lex->hash : 0) || index->lines != editorInfo.linecount) {
+        return false;
+    }
+
+    //A state past the lexer's strings would index past its rules once it's lexed from.
+    unsigned short *states = (unsigned short*)(index + 1);
+    ebracket *br = (ebracket*)(states + index->lines);
+    int stateLimit = LexInString + (lex ? lex->stringCount : 0);
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        if (states[i] >= stateLimit) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        editorInfo.line[i].hlOpenComment = states[i];
+        editorInfo.line[i].hlExact = true;
+        memcpy(&editorInfo.line[i].br, &br[i], sizeof(ebracket));
+    }
+
+    editorInfo.hlFrontier = editorInfo.linecount;
+    editorInfo.hlResume = false;
+    editorInfo.brDirty = true;
+    return true;
+}
+
+void eIndexSave(eloadindex *pending) {
+    char path[PATH_MAX];
+    if (!eIndexPath(editorInfo.filename, path)) {
+        return;
+    }
+
+    eindex index = {{'S', 'H', 'I', 'X'}, INDEX_VERSION, pending->size, pending->mtime, pending->hash, 0,
+                    editorInfo.linecount};
+    if (editorInfo.syntax && editorInfo.syntax->lex) {
+        index.lexHash = editorInfo.syntax->lex->hash;
+    }
+
+    unsigned short *states = (unsigned short*)malloc(sizeof(unsigned short) * (index.lines + 1));
+    ebracket *br = (ebracket*)malloc(sizeof(ebracket) * (index.lines + 1));
+    for (int i = 0; i < index.lines; ++i) {
+        states[i] = (unsigned short)editorInfo.line[i].hlOpenComment;
+        br[i] = editorInfo.line[i].br;
+    }
+
+    struct iovec iov[3] = {
+            {&index, sizeof(index)},
+            {states, sizeof(unsigned short) * index.lines},
+            {br, sizeof(ebracket) * index.lines}
+    };
+    eCacheWrite(path, iov, 3);
+
+    free(states);
+    free(br);
+}
+
+//Writes a freshly opened file's index once every line's state is exact, if the buffer still holds what was read.
+void eIndexIdle() {
+    eloadindex *pending = editorInfo.index;
+    if (pending == NULL || editorInfo.hlFrontier < editorInfo.linecount) {
+        return;
+    }
+    editorInfo.index = NULL;
+
+    struct stat st;
+    if (editorInfo.dirty == 0 && editorInfo.undo.count == 0 && stat(editorInfo.filename, &st) == 0 &&
+            st.st_size == pending->size && eStatMtime(&st) == pending->mtime) {
+        eIndexSave(pending);
+    }
+
+    free(pending);
+}
+
+void eOpen(char *filename) {
+    eReset();
+    
+    free(editorInfo.filename);
+    editorInfo.filename = strdup(filename);
+    eSetFilenameTrunc();
+
+    eSelectSyntaxHL();
+
+    //If the file doesn't exist then treat it as a new file.
+    if (access(filename, F_OK) != 0) {
+        firstMessage = false;
+
+        eInsertNewLine();
+        eMove(vk_up);
+
+        eSetStatus("New file '%s'", filename);
+        editorInfo.dirty = 0;
+        return;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        die("open");
+    }
+
+    //Only big files are worth an index.
+    eloadindex *index = NULL;
+    eindex *cached = NULL;
+    if (st.st_size >= INDEX_MIN_SIZE) {
+        index = (eloadindex*)calloc(1, sizeof(eloadindex));
+        index->size = st.st_size;
+        index->mtime = eStatMtime(&st);
+        cached = eIndexLoad(filename, &st);
+    }
+
+    editorInfo.line = eLoadLines(fd, st.st_size, &editorInfo.arena, &editorInfo.linecount, true, index);
+    close(fd);
+
+    if (editorInfo.line == NULL) {
+        editorInfo.linecount = 0;
+        free(index);
+        free(cached);
+        eSetError("Can't read '%s': %s", filename, strerror(errno));
+        return;
+    }
+
+    //An index that's out of date, or was made with another syntax, gets replaced once the highlighting's done.
+    if (cached && cached->hash == index->hash && eIndexApply(cached)) {
+        free(index);
+    } else {
+        editorInfo.index = index;
+    }
+    free(cached);
+
+    editorInfo.linecap = editorInfo.linecount;
+    editorInfo.fileSize = st.st_size;
+    editorInfo.fileMtime = eStatMtime(&st);
+    editorInfo.arenaSize = st.st_size + 1;
+    editorInfo.arenaRefs = editorInfo.linecount;
+    editorInfo.zNext = 0;
+    editorInfo.maxLineLen = getNumDigits(editorInfo.linecount);
+
+    if (editorInfo.useTrigram || st.st_size >= TRIGRAM_AUTO_SIZE) {
+        eTrigramStart();
+    }
+
+    editorInfo.dirty = 0;
+}
+
+unsigned long long eHashLine(const char *data, int size) {
+    unsigned long long h = 1469598103934665603ULL ^ (unsigned long long)size;
+    for (int i = 0; i < size; ++i) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+
+    return h;
+}
+
+//Hashes a whole file. A byte at a time is too slow for that, so it's read eight at a time into four lanes that don't
+//wait on each other.
+unsigned long long eHashData(const char *data, long long size) {
+    unsigned long long lanes[4] = {1469598103934665603ULL ^ (unsigned long long)size, 1, 2, 3};
+    long long i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            unsigned long long w;
+            memcpy(&w, data + i + j * 8, 8);
+            lanes[j] = (lanes[j] ^ w) * 0x9e3779b97f4a7c15ULL;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+
+    unsigned long long h = eHashLine(data + i, (int)(size - i));
+    for (int j = 0; j < 4; ++j) {
+        h = (h ^ lanes[j]) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+typedef struct ehunk {
+    int oldStart;
+    int oldCount;
+    int newStart;
+    int newCount;
+} ehunk;
+
+//Myers' O(ND) diff of two runs of line hashes. Writes the edit script to ops as '=', '-' and '+' and returns its length,
+//or -1 if more than RELOAD_MAX_D lines differ.
+int eMyersDiff(unsigned long long *a, int n, unsigned long long *b, int m, char *ops) {
+    int maxD = n + m < RELOAD_MAX_D ? n + m : RELOAD_MAX_D;
+    int off = maxD + 1;
+    int *v = (int*)calloc(2 * maxD + 3, sizeof(int));
+    int **trace = (int**)malloc(sizeof(int*) * (maxD + 1));
+
+    int d = 0;
+    bool found = false;
+    for (; d <= maxD && !found; ++d) {
+        //Only the diagonals this round can look at are kept.
+        trace[d] = (int*)malloc(sizeof(int) * (2 * d + 3));
+        memcpy(trace[d], &v[off - d - 1], sizeof(int) * (2 * d + 3));
+
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) ? v[off + k + 1] : v[off + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                ++x;
+                ++y;
+            }
+
+            v[off + k] = x;
+            if (x >= n && y >= m) {
+                found = true;
+                break;
+            }
+        }
+    }
+
+    int len = -1;
+    if (found) {
+        //Walk back from the end, writing the script backwards.
+        len = 0;
+        int x = n, y = m;
+        for (int D = d - 1; D >= 0; --D) {
+            int *tv = trace[D] + D + 1;
+            int k = x - y;
+            int prevK = (k == -D || (k != D && tv[k - 1] < tv[k + 1])) ? k + 1 : k - 1;
+            int prevX = D > 0 ? tv[prevK] : 0;
+            int prevY = prevX - prevK;
+
+            while (x > prevX && y > prevY) {
+                ops[len++] = '=';
+                --x;
+                --y;
+            }
+
+            if (D > 0) {
+                ops[len++] = x == prevX ? '+' : '-';
+            }
+            x = prevX;
+            y = prevY;
+        }
+
+        for (int i = 0; i < len / 2; ++i) {
+            char c = ops[i];
+            ops[i] = ops[len - 1 - i];
+            ops[len - 1 - i] = c;
+        }
+    }
+
+    for (int i = 0; i < d; ++i) {
+        free(trace[i]);
+    }
+    free(trace);
+    free(v);
+
+    return len;
+}
+
+//Diffs the lines on disk against the buffer and replaces only the line ranges that changed. The lines that didn't
+//change keep their rendering and highlighting.
+void eReload(bool force) {
+    if (editorInfo.filename == NULL || stream.active || view.active) {
+        eSetError("No file to reload");
+        return;
+    }
+
+    if (editorInfo.dirty > 0 && !force) {
+        eSetError("No write since last change (:e! to override)");
+        return;
+    }
+
+    eSaveWait();
+
+    int fd = open(editorInfo.filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        eSetError("Can't reload '%s': %s", editorInfo.filenameTrunc, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    char *arena;
+    int count;
+    eline *nl = eLoadLines(fd, st.st_size, &arena, &count, false, NULL);
+    close(fd);
+    if (nl == NULL) {
+        eSetError("Can't reload '%s': %s", editorInfo.filenameTrunc, strerror(errno));
+        return;
+    }
+
+    //Trim what's the same at both ends. What's left is usually tiny.
+    int oldCount = editorInfo.linecount;
+    int pre = 0;
+    while (pre < oldCount && pre < count) {
+        eline *l = &editorInfo.line[pre];
+        if (l->size != nl[pre].size || memcmp(eLineDataTemp(l), nl[pre].data, l->size) != 0) {
+            break;
+        }
+        ++pre;
+    }
+
+    int suf = 0;
+    while (suf < oldCount - pre && suf < count - pre) {
+        eline *l = &editorInfo.line[oldCount - 1 - suf];
+        eline *r = &nl[count - 1 - suf];
+        if (l->size != r->size || memcmp(eLineDataTemp(l), r->data, l->size) != 0) {
+            break;
+        }
+        ++suf;
+    }
+
+    int n = oldCount - pre - suf;
+    int m = count - pre - suf;
+    unsigned long long *a = (unsigned long long*)malloc(sizeof(unsigned long long) * (n + 1));
+    unsigned long long *b = (unsigned long long*)malloc(sizeof(unsigned long long) * (m + 1));
+    for (int i = 0; i < n; ++i) {
+        eline *l = &editorInfo.line[pre + i];
+        a[i] = eHashLine(eLineDataTemp(l), l->size);
+    }
+    for (int i = 0; i < m; ++i) {
+        b[i] = eHashLine(nl[pre + i].data, nl[pre + i].size);
+    }
+
+    //Turn the edit script into hunks. Too many differences just make the middle one hunk.
+    char *ops = (char*)malloc(n + m + 1);
+    int opCount = eMyersDiff(a, n, b, m, ops);
+    ehunk *hunks = (ehunk*)malloc(sizeof(ehunk) * (n + m + 1));
+    int hunkCount = 0;
+    if (opCount == -1) {
+        if (n > 0 || m > 0) {
+            hunks[hunkCount++] = (ehunk){pre, n, pre, m};
+        }
+    } else {
+        int x = pre, y = pre;
+        for (int i = 0; i < opCount;) {
+            if (ops[i] == '=') {
+                ++x;
+                ++y;
+                ++i;
+                continue;
+            }
+
+            ehunk *h = &hunks[hunkCount++];
+            *h = (ehunk){x, 0, y, 0};
+            for (; i < opCount && ops[i] != '='; ++i) {
+                if (ops[i] == '-') {
+                    ++h->oldCount;
+                    ++x;
+                } else {
+                    ++h->newCount;
+                    ++y;
+                }
+            }
+        }
+    }
+
+    //Apply from the bottom up so the hunks above keep their positions.
+    int changed = 0;
+    eline *ins = NULL;
+    for (int i = hunkCount - 1; i >= 0; --i) {
+        ehunk *h = &hunks[i];
+        ins = (eline*)realloc(ins, sizeof(eline) * (h->newCount + 1));
+        for (int j = 0; j < h->newCount; ++j) {
+            eline *src = &nl[h->newStart + j];
+            ins[j] = *src;
+            ins[j].data = (char*)malloc(src->size + 1);
+            memcpy(ins[j].data, src->data, src->size + 1);
+            ins[j].cowSeq = editorInfo.snapshotSeq;
+            eRenderLine(&ins[j]);
+        }
+
+        eSpliceLines(h->oldStart, h->oldCount, ins, h->newCount);
+        changed += h->oldCount > h->newCount ? h->oldCount : h->newCount;
+
+        if (editorInfo.cy >= h->oldStart + h->oldCount) {
+            editorInfo.cy += h->newCount - h->oldCount;
+        } else if (editorInfo.cy >= h->oldStart && editorInfo.cy - h->oldStart >= h->newCount) {
+            editorInfo.cy = h->oldStart + h->newCount;
+        }
+    }
+
+    //Highlight the new lines plus the one after each hunk. eUpdateSyntaxRange keeps going if a comment opened or closed.
+    for (int i = 0; i < hunkCount; ++i) {
+        eUpdateSyntaxRange(hunks[i].newStart, hunks[i].newStart + hunks[i].newCount + 1);
+    }
+
+    free(ins);
+    free(hunks);
+    free(ops);
+    free(a);
+    free(b);
+    free(nl);
+    free(arena);
+
+    if (editorInfo.cy > editorInfo.linecount) {
+        editorInfo.cy = editorInfo.linecount;
+    }
+    int linelen = editorInfo.cy < editorInfo.linecount ? editorInfo.line[editorInfo.cy].size : 0;
+    if (editorInfo.cx > linelen) {
+        editorInfo.cx = linelen;
+    }
+
+    editorInfo.fileSize = st.st_size;
+    editorInfo.fileMtime = eStatMtime(&st);
+    editorInfo.diskChanged = false;
+    editorInfo.dirty = 0;
+    eUndoClear();
+    eSetStatus("Reloaded '%s', %d lines changed", editorInfo.filenameTrunc, changed);
+}
 
-            buf[buflen++] = (char)k;
-            buf[buflen] = '\0';
-        }
+//Looks for changes made to the file by someone else every so often. A clean buffer just gets reloaded.
+void eDiskIdle() {
+    if (editorInfo.filename == NULL || editorInfo.fileMtime == 0 || stream.active || follow.active || saveJob.active) {
+        return;
+    }
 
-        if (callback) {
-            callback(buf, k);
-        }
+    long long now = eTimeUs();
+    if (now - editorInfo.diskCheck < DISK_CHECK_US) {
+        return;
+    }
+    editorInfo.diskCheck = now;
+
+    struct stat st;
+    if (stat(editorInfo.filename, &st) == -1 || (st.st_size == editorInfo.fileSize && eStatMtime(&st) == editorInfo.fileMtime)) {
+        return;
+    }
+
+    if (editorInfo.dirty == 0) {
+        eReload(false);
+    } else if (!editorInfo.diskChanged) {
+        editorInfo.diskChanged = true;
+        eSetError("'%s' changed on disk (:e! to reload)", editorInfo.filenameTrunc);
     }
+    needsRedraw = true;
 }
 
-void eMove(int k) {
-    eline *line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
+void eViewAddCheckpoint(eview *v, long long off) {
+    pthread_mutex_lock(&v->lock);
+    if (v->checkpointCount == v->checkpointCap) {
+        v->checkpointCap *= 2;
+        v->checkpoints = (long long*)realloc(v->checkpoints, sizeof(long long) * v->checkpointCap);
+    }
+    v->checkpoints[v->checkpointCount++] = off;
+    pthread_mutex_unlock(&v->lock);
+}
 
-    switch (k) {
-        case vk_left: {
-            if (editorInfo.cx != 0) {
-                --editorInfo.cx;
-            } else if (editorInfo.cy > 0) {
-                --editorInfo.cy;
-                editorInfo.cx = editorInfo.line[editorInfo.cy].size;
+//Reads the whole file once, counting lines and recording checkpoints.
+void *eViewIndexThread(void *arg) {
+    eview *v = (eview*)arg;
+    char *buf = (char*)malloc(VIEW_SCAN_CHUNK);
+    long long off = 0;
+    long long lines = 0;
+    char last = '\n';
+
+    while (off < v->size && !__atomic_load_n(&v->stop, __ATOMIC_RELAXED)) {
+        ssize_t n = pread(v->fd, buf, VIEW_SCAN_CHUNK, off);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
             }
-            
-            editorInfo.tx = editorInfo.cx;
-        } break;
+            break;
+        }
 
-        case vk_right: {
-            if (line && editorInfo.cx < line->size) {
-                ++editorInfo.cx;
-            } else if (line && editorInfo.cx == line->size) {
-                ++editorInfo.cy;
-                editorInfo.cx = 0;
+        char *p = buf;
+        char *end = buf + n;
+        while ((p = (char*)memchr(p, '\n', end - p)) != NULL) {
+            ++p;
+            if (++lines % VIEW_CHECKPOINT == 0) {
+                eViewAddCheckpoint(v, off + (p - buf));
             }
-            
-            editorInfo.tx = editorInfo.cx;
-        } break;
+        }
 
-        case vk_up: {
-            if (editorInfo.cy != 0) {
-                --editorInfo.cy;
-            }
-        } break;
+        last = buf[n - 1];
+        off += n;
+        __atomic_store_n(&v->scanned, off, __ATOMIC_RELEASE);
+    }
 
-        case vk_down: {
-            if (editorInfo.cy < editorInfo.linecount) {
-                ++editorInfo.cy;
+    v->total = lines + (last != '\n');
+    __atomic_store_n(&v->done, 1, __ATOMIC_RELEASE);
+    free(buf);
+
+    return NULL;
+}
+
+//Finds the start of the line want lines before the one starting at off, or the start of the file if that comes first.
+long long eViewBack(long long off, int want, int *found) {
+    char buf[STREAM_CHUNK];
+    *found = 0;
+    if (off == 0 || want == 0) {
+        return off;
+    }
+
+    //The newline at off - 1 ends the line before off, so the search starts just before it.
+    long long pos = off - 1;
+    while (pos > 0) {
+        int n = pos < (long long)sizeof(buf) ? (int)pos : (int)sizeof(buf);
+        long long at = pos - n;
+        if (pread(view.fd, buf, n, at) != n) {
+            break;
+        }
+
+        for (int i = n - 1; i >= 0; --i) {
+            if (buf[i] == '\n' && ++*found == want) {
+                return at + i + 1;
             }
-        } break;
+        }
+        pos = at;
+    }
 
-        default: break;
+    ++*found;
+    return 0;
+}
+
+//Finds the end of the want lines starting at off, or the end of the file if that comes first.
+long long eViewForward(long long off, int want, int *found) {
+    char buf[STREAM_CHUNK];
+    long long lineStart = off;
+    *found = 0;
+
+    while (off < view.size && *found < want) {
+        ssize_t n = pread(view.fd, buf, sizeof(buf), off);
+        if (n <= 0) {
+            break;
+        }
+
+        char *p = buf;
+        char *end = buf + n;
+        while (*found < want && (p = (char*)memchr(p, '\n', end - p)) != NULL) {
+            ++p;
+            ++*found;
+            lineStart = off + (p - buf);
+        }
+
+        if (*found == want) {
+            return lineStart;
+        }
+        off += n;
     }
 
-    line = (editorInfo.cy >= editorInfo.linecount) ? NULL : &editorInfo.line[editorInfo.cy];
-    int linelen = line ? line->size : 0;
-    
-    if (editorInfo.tx > editorInfo.cx) {
-        editorInfo.cx = editorInfo.tx;
+    if (*found == want) {
+        return lineStart;
     }
-    
-    if (editorInfo.cx > linelen) {
-        editorInfo.cx = linelen;
+
+    //The last line doesn't have to end in a newline.
+    if (lineStart < view.size) {
+        ++*found;
     }
+
+    return view.size;
 }
 
-int eReadKey() {
-    int nread;
-    char c;
+//Replaces the lines in memory with the ones in [start, end) of the file.
+void eViewLoad(long long start, long long end) {
+    //An index would point at lines from the old window.
+    eTrigramFree();
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        eFreeLine(&editorInfo.line[i]);
+    }
+    free(editorInfo.line);
+
+    long long len = end - start;
+    char *buf = (char*)malloc(len + 1);
+    long long got = 0;
+    while (got < len) {
+        ssize_t n = pread(view.fd, buf + got, len - got, start + got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("read");
+    int count = 0;
+    for (char *p = buf; (p = (char*)memchr(p, '\n', buf + got - p)) != NULL; ++p) {
+        ++count;
+    }
+    bool trailing = got > 0 && buf[got - 1] != '\n';
+
+    eline *lines = (eline*)malloc(sizeof(eline) * (count + trailing + 1));
+    long long lineStart = 0;
+    int idx = 0;
+    for (char *p = buf; (p = (char*)memchr(p, '\n', buf + got - p)) != NULL; ++p) {
+        eLoadInitLine(&lines[idx], idx, buf, lineStart, p - buf, true);
+        lineStart = p - buf + 1;
+        ++idx;
+    }
+    if (trailing) {
+        eLoadInitLine(&lines[idx], idx, buf, lineStart, got, true);
+        ++idx;
+    }
+
+    editorInfo.line = lines;
+    editorInfo.linecount = idx;
+    editorInfo.linecap = idx;
+    editorInfo.arena = buf;
+    editorInfo.arenaSize = got + 1;
+    editorInfo.arenaRefs = idx;
+    if (idx == 0) {
+        free(buf);
+        editorInfo.arena = NULL;
+        editorInfo.arenaSize = 0;
+    }
+
+    view.start = start;
+    view.end = start + got;
+    eUpdateSyntaxRange(0, editorInfo.linecount);
+}
+
+//Loads a window of lines around the line starting at off, whose number is lineNo or -1 if it isn't known.
+//Returns where that line ended up in the window.
+int eViewPage(long long off, long long lineNo) {
+    int back, fwd;
+    long long start = eViewBack(off, VIEW_WINDOW / 2, &back);
+    long long end = eViewForward(off, VIEW_WINDOW / 2, &fwd);
+
+    eViewLoad(start, end);
+    view.base = lineNo >= 0 ? lineNo - back : -1;
+
+    return back;
+}
+
+//Returns the number of a line in the window, or -1 if the index hasn't got that far.
+long long eLineNumber(int idx) {
+    if (!view.active) {
+        return idx;
+    }
+
+    return view.base >= 0 ? view.base + idx : -1;
+}
+
+//Works out the number of the line starting at off from the checkpoint before it. Returns -1 if it isn't indexed yet.
+long long eViewLineAt(long long off) {
+    if (__atomic_load_n(&view.scanned, __ATOMIC_ACQUIRE) < off && !__atomic_load_n(&view.done, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&view.lock);
+    int lo = 0, hi = view.checkpointCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (view.checkpoints[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
     }
+    long long cp = view.checkpoints[lo];
+    pthread_mutex_unlock(&view.lock);
+
+    char buf[STREAM_CHUNK];
+    long long line = (long long)lo * VIEW_CHECKPOINT;
+    while (cp < off) {
+        int n = off - cp < (long long)sizeof(buf) ? (int)(off - cp) : (int)sizeof(buf);
+        if (pread(view.fd, buf, n, cp) != n) {
+            return -1;
+        }
 
-    if (c == '\x1b') {
-        char seq[3];
+        for (char *p = buf; (p = (char*)memchr(p, '\n', buf + n - p)) != NULL; ++p) {
+            ++line;
+        }
+        cp += n;
+    }
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-            return '\x1b';
+    return line;
+}
+
+void eViewOpen(char *filename) {
+    eReset();
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        eSetError("Can't open '%s': %s", filename, strerror(errno));
+        if (fd != -1) {
+            close(fd);
         }
+        return;
+    }
 
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-            return '\x1b';
+    free(editorInfo.filename);
+    editorInfo.filename = strdup(filename);
+    eSetFilenameTrunc();
+    eSelectSyntaxHL();
+
+    view.fd = fd;
+    view.size = st.st_size;
+    view.base = 0;
+    view.total = 0;
+    view.scanned = 0;
+    view.done = 0;
+    view.doneShown = false;
+    view.stop = 0;
+    view.checkpointCap = 1024;
+    view.checkpoints = (long long*)malloc(sizeof(long long) * view.checkpointCap);
+    view.checkpoints[0] = 0;
+    view.checkpointCount = 1;
+    view.active = true;
+
+    if (pthread_create(&view.thread, NULL, eViewIndexThread, &view) != 0) {
+        die("eViewOpen");
+    }
+
+    eViewPage(0, 0);
+    editorInfo.maxLineLen = getNumDigits(editorInfo.linecount);
+    editorInfo.mode = CMD;
+    eSetStatus("Viewing '%s' read-only", editorInfo.filenameTrunc);
+}
+
+void eViewClose() {
+    if (!view.active) {
+        return;
+    }
+
+    __atomic_store_n(&view.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(view.thread, NULL);
+    close(view.fd);
+    free(view.checkpoints);
+    view.checkpoints = NULL;
+    view.active = false;
+}
+
+//Pages in a new window once the cursor gets close to either end of the one in memory.
+void eViewScroll() {
+    if (!view.active || editorInfo.linecount == 0) {
+        return;
+    }
+
+    int margin = editorInfo.h * 2;
+    bool up = editorInfo.cy < margin && view.start > 0;
+    bool down = editorInfo.cy >= editorInfo.linecount - margin && view.end < view.size;
+    if (!up && !down) {
+        return;
+    }
+
+    int cy = editorInfo.cy < editorInfo.linecount ? editorInfo.cy : editorInfo.linecount - 1;
+    long long off = view.start + (editorInfo.line[cy].data - editorInfo.arena);
+    int idx = eViewPage(off, eLineNumber(cy) >= 0 ? eLineNumber(cy) : -1);
+
+    editorInfo.yoffset += idx - cy;
+    if (editorInfo.yoffset < 0) {
+        editorInfo.yoffset = 0;
+    }
+    editorInfo.cy += idx - cy;
+}
+
+void eViewGoto(long long n) {
+    int c = (int)(n / VIEW_CHECKPOINT);
+    long long off = -1;
+    pthread_mutex_lock(&view.lock);
+    if (c < view.checkpointCount) {
+        off = view.checkpoints[c];
+    }
+    pthread_mutex_unlock(&view.lock);
+
+    if (off == -1) {
+        eSetError("Line %lld isn't indexed yet", n + 1);
+        return;
+    }
+
+    int skip = (int)(n - (long long)c * VIEW_CHECKPOINT);
+    int found;
+    off = eViewForward(off, skip, &found);
+    if (found < skip || off >= view.size) {
+        eGotoEnd();
+        return;
+    }
+
+    editorInfo.cy = eViewPage(off, n);
+    editorInfo.cx = 0;
+    editorInfo.yoffset = editorInfo.cy - editorInfo.h / 2;
+    if (editorInfo.yoffset < 0) {
+        editorInfo.yoffset = 0;
+    }
+}
+
+//Going to the end only reads backwards from the end of the file, so it works before the index is done.
+void eViewEnd() {
+    if (view.size == 0) {
+        return;
+    }
+
+    //Searching back from one past the end finds the start of a last line that doesn't end in a newline.
+    char last = '\n';
+    pread(view.fd, &last, 1, view.size - 1);
+    int found;
+    long long off = eViewBack(last == '\n' ? view.size : view.size + 1, 1, &found);
+
+    editorInfo.cy = eViewPage(off, view.done ? view.total - 1 : -1);
+    editorInfo.cx = 0;
+    editorInfo.yoffset = editorInfo.cy - editorInfo.h + 1;
+    if (editorInfo.yoffset < 0) {
+        editorInfo.yoffset = 0;
+    }
+}
+
+//Fills in line numbers as the index catches up with the window.
+void eViewIdle() {
+    if (!view.active) {
+        return;
+    }
+
+    bool changed = false;
+    if (view.base < 0) {
+        view.base = eViewLineAt(view.start);
+        changed = view.base >= 0;
+    }
+
+    bool done = __atomic_load_n(&view.done, __ATOMIC_ACQUIRE);
+    long long lines = done ? view.total : (long long)view.checkpointCount * VIEW_CHECKPOINT;
+    if (view.base + editorInfo.linecount > lines) {
+        lines = view.base + editorInfo.linecount;
+    }
+    if (getNumDigits(lines) != editorInfo.maxLineLen) {
+        editorInfo.maxLineLen = getNumDigits(lines);
+        changed = true;
+    }
+
+    //Redraw while indexing to keep the progress current, and once more when it's done.
+    if (changed || !view.doneShown) {
+        view.doneShown = done;
+        needsRedraw = true;
+    }
+}
+
+void eGotoLine(long long n) {
+    if (n < 0) {
+        n = 0;
+    }
+
+    if (view.active) {
+        eViewGoto(n);
+        return;
+    }
+
+    editorInfo.cy = n < editorInfo.linecount ? (int)n : editorInfo.linecount;
+    editorInfo.cx = 0;
+}
+
+void eGotoEnd() {
+    if (view.active) {
+        eViewEnd();
+        return;
+    }
+
+    editorInfo.cy = editorInfo.linecount > 0 ? editorInfo.linecount - 1 : 0;
+    editorInfo.cx = 0;
+}
+
+void *eStreamThread(void *arg) {
+    estream *st = (estream*)arg;
+
+    //A FIFO is opened without blocking. Polling it then waits for a writer to show up.
+    if (st->fd == -1) {
+        st->fd = open(st->path, O_RDONLY | O_NONBLOCK);
+    }
+
+    char chunk[STREAM_CHUNK];
+    ssize_t n = -1;
+    while (st->fd != -1) {
+        //Anything on the wake pipe means eStreamClose wants us gone.
+        struct pollfd pfd[2] = {{st->fd, POLLIN, 0}, {st->wake[0], POLLIN, 0}};
+        if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+            n = -1;
+            break;
         }
 
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] < '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
+        if (pfd[1].revents) {
+            n = 0;
+            break;
+        }
 
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '3': return vk_delete;
-                        case '5': return vk_pageup;
-                        case '6': return vk_pagedown;
-                        case '1':
-                        case '7': return vk_home;
-                        case '4':
-                        case '8': return vk_end;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return vk_up;
-                    case 'B': return vk_down;
-                    case 'C': return vk_right;
-                    case 'D': return vk_left;
-                    case 'H': return vk_home;
-                    case 'F': return vk_end;
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return vk_home;
-                case 'F': return vk_end;
+        if ((n = read(st->fd, chunk, sizeof(chunk))) == 0) {
+            break;
+        }
+
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
+            break;
         }
 
-        return '\x1b';
+        pthread_mutex_lock(&st->lock);
+        if (st->len + n > st->cap) {
+            st->cap = st->len + n > st->cap * 2 ? st->len + n : st->cap * 2;
+            st->buf = (char*)realloc(st->buf, st->cap);
+        }
+        memcpy(&st->buf[st->len], chunk, n);
+        st->len += n;
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->err = n == -1 ? errno : 0;
+    st->eof = true;
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+//Reads stdin (path is NULL and fd is a dup of it) or a FIFO in the background. Lines show up as they arrive.
+void eStreamOpen(char *path, int fd) {
+    eReset();
+
+    stream.path = path ? strdup(path) : NULL;
+    stream.fd = fd;
+    stream.eof = false;
+    stream.err = 0;
+    stream.bytes = 0;
+    stream.active = true;
+
+    if (pipe(stream.wake) == -1 || pthread_create(&stream.thread, NULL, eStreamThread, &stream) != 0) {
+        die("eStreamOpen");
+    }
+}
+
+void eStreamAppend(char *data, int len) {
+    if (len > 0 && data[len - 1] == '\r') {
+        --len;
+    }
+
+    //What's read isn't an edit, so it doesn't make the buffer dirty, go into the undo history or keep it from being
+    //compressed.
+    int dirty = editorInfo.dirty;
+    ++editorInfo.undo.suspend;
+    eInsertLine(editorInfo.linecount, data, len);
+    --editorInfo.undo.suspend;
+    editorInfo.line[editorInfo.linecount - 1].modified = false;
+    editorInfo.dirty = dirty;
+}
+
+void eStreamClose() {
+    if (!stream.active) {
+        return;
     }
 
-    return c;
+    write(stream.wake[1], "", 1);
+    pthread_join(stream.thread, NULL);
+    close(stream.wake[0]);
+    close(stream.wake[1]);
+    if (stream.fd != -1) {
+        close(stream.fd);
+    }
+
+    free(stream.path);
+    free(stream.buf);
+    free(stream.pending);
+    free(stream.partial);
+    stream.path = NULL;
+    stream.buf = NULL;
+    stream.pending = NULL;
+    stream.partial = NULL;
+    stream.len = stream.cap = 0;
+    stream.pendingLen = stream.pendingOff = 0;
+    stream.partialLen = 0;
+    stream.active = false;
 }
 
-int cursorPosition(int *x, int *y) {
-    char buf[32];
-    unsigned int i = 0;
+//Appends whatever the reader has got so far. Returns true if there's more to do.
+bool eStreamIdle(long long deadline) {
+    if (!stream.active) {
+        return false;
+    }
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-        return -1;
+    bool eof = false;
+    if (stream.pendingOff == stream.pendingLen) {
+        free(stream.pending);
+
+        pthread_mutex_lock(&stream.lock);
+        stream.pending = stream.buf;
+        stream.pendingLen = stream.len;
+        stream.pendingOff = 0;
+        stream.buf = NULL;
+        stream.len = stream.cap = 0;
+        eof = stream.eof;
+        pthread_mutex_unlock(&stream.lock);
+
+        stream.bytes += stream.pendingLen;
     }
 
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+    int start = editorInfo.linecount;
+    while (stream.pendingOff < stream.pendingLen) {
+        char *p = &stream.pending[stream.pendingOff];
+        int left = stream.pendingLen - stream.pendingOff;
+        char *nl = (char*)memchr(p, '\n', left);
+        if (nl == NULL) {
+            stream.partial = (char*)realloc(stream.partial, stream.partialLen + left);
+            memcpy(&stream.partial[stream.partialLen], p, left);
+            stream.partialLen += left;
+            stream.pendingOff = stream.pendingLen;
             break;
         }
 
-        if (buf[i] == 'R') {
+        int len = nl - p;
+        if (stream.partialLen > 0) {
+            stream.partial = (char*)realloc(stream.partial, stream.partialLen + len);
+            memcpy(&stream.partial[stream.partialLen], p, len);
+            eStreamAppend(stream.partial, stream.partialLen + len);
+            stream.partialLen = 0;
+        } else {
+            eStreamAppend(p, len);
+        }
+        stream.pendingOff += len + 1;
+
+        if (eTimeUs() > deadline) {
             break;
         }
+    }
 
-        ++i;
+    if (editorInfo.linecount > start) {
+        needsRedraw = true;
     }
-    buf[i] = '\0';
 
-    if (buf[0] != '\x1b' || buf[1] != '[') {
-        return -1;
+    if (!eof || stream.pendingOff < stream.pendingLen) {
+        return stream.pendingOff < stream.pendingLen;
     }
 
-    if (sscanf(&buf[2], "%d;%d", y, x) != 2) {
-        return -1;
+    if (stream.partialLen > 0) {
+        eStreamAppend(stream.partial, stream.partialLen);
     }
 
-    return 0;
+    int err = stream.err;
+    char *name = stream.path ? strdup(stream.path) : NULL;
+    eStreamClose();
+
+    if (err != 0) {
+        eSetError("Can't read '%s': %s", name ? name : "stdin", strerror(err));
+    } else {
+        eSetStatus("Read %d lines from %s", editorInfo.linecount, name ? name : "stdin");
+    }
+    free(name);
+    needsRedraw = true;
+
+    return false;
 }
 
-int windowSize(int *w, int *h) {
-    struct winsize ws;
+//Starts following the end of the open file from where it was loaded or last saved.
+bool eFollowStart() {
+    if (follow.active) {
+        return true;
+    }
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-            return -1;
-        }
+    if (editorInfo.filename == NULL || stream.active || view.active) {
+        eSetError("Nothing to follow");
+        return false;
+    }
 
-        return cursorPosition(w, h);
+    follow.fd = open(editorInfo.filename, O_RDONLY);
+    if (follow.fd == -1) {
+        eSetError("Can't follow '%s': %s", editorInfo.filename, strerror(errno));
+        return false;
     }
 
-    *w = ws.ws_col;
-    *h = ws.ws_row;
+    //Without inotify the file just gets checked once in a while.
+    follow.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow.inotify != -1 && inotify_add_watch(follow.inotify, editorInfo.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        close(follow.inotify);
+        follow.inotify = -1;
+    }
 
-    return 0;
+    //If the file didn't end in a newline then the last line is still being written.
+    char last = '\n';
+    follow.offset = editorInfo.fileSize;
+    follow.tailOpen = follow.offset > 0 && pread(follow.fd, &last, 1, follow.offset - 1) == 1 && last != '\n';
+    follow.lastCheck = eTimeUs();
+    follow.active = true;
+
+    return true;
 }
 
-char *eLinesToStr(int *buflen) {
-    int totlen = 0;
-    for (int i = 0; i < editorInfo.linecount; ++i) {
-        totlen += editorInfo.line[i].size + 1;
+void eFollowStop() {
+    if (!follow.active) {
+        return;
+    }
+
+    close(follow.fd);
+    if (follow.inotify != -1) {
+        close(follow.inotify);
     }
-    *buflen = totlen;
+    follow.active = false;
+}
 
-    char *buf = (char*)malloc(totlen);
-    char *p = buf;
+//Appends new data to the buffer. Only the appended lines get rendered and highlighted.
+void eFollowAppend(char *data, int len) {
+    int dirty = editorInfo.dirty;
 
-    for (int i = 0; i < editorInfo.linecount; ++i) {
-        memcpy(p, editorInfo.line[i].data, editorInfo.line[i].size);
-        p += editorInfo.line[i].size;
-        *p = '\n';
-        ++p;
+    while (len > 0) {
+        char *nl = (char*)memchr(data, '\n', len);
+        int n = nl ? nl - data : len;
+
+        if (follow.tailOpen && editorInfo.linecount > 0) {
+            eline *line = &editorInfo.line[editorInfo.linecount - 1];
+            ++editorInfo.undo.suspend;
+            eLineAppendString(line, data, n);
+            --editorInfo.undo.suspend;
+            line->modified = false;
+        } else {
+            eStreamAppend(data, n);
+        }
+
+        follow.tailOpen = nl == NULL;
+        data += n + (nl != NULL);
+        len -= n + (nl != NULL);
     }
 
-    return buf;
+    editorInfo.dirty = dirty;
 }
 
-void eOpen(char *filename) {
-    eReset();
-    
-    free(editorInfo.filename);
-    editorInfo.filename = strdup(filename);
-    eSetFilenameTrunc();
+//Checks the file for appended data. It's only stat'd when inotify says it changed, or every so often without inotify.
+void eFollowIdle() {
+    if (!follow.active) {
+        return;
+    }
 
-    eSelectSyntaxHL();
+    bool changed = false;
+    if (follow.inotify != -1) {
+        char events[4096];
+        while (read(follow.inotify, events, sizeof(events)) > 0) {
+            changed = true;
+        }
+    }
 
-    //If the file doesn't exist then treat it as a new file.
-    if (access(filename, F_OK) != 0) {
-        firstMessage = false;
+    long long now = eTimeUs();
+    if (!changed && now - follow.lastCheck < FOLLOW_CHECK_US) {
+        return;
+    }
+    follow.lastCheck = now;
+
+    //A rotated or replaced file isn't the one we're following anymore.
+    struct stat st, pathSt;
+    if (fstat(follow.fd, &st) == -1 || stat(editorInfo.filename, &pathSt) == -1 || st.st_ino != pathSt.st_ino || st.st_dev != pathSt.st_dev) {
+        eFollowStop();
+        eSetError("'%s' was moved or replaced, stopped following", editorInfo.filenameTrunc);
+        needsRedraw = true;
+        return;
+    }
 
-        eInsertNewLine();
-        eMove(vk_up);
+    if (st.st_size < follow.offset) {
+        eFollowStop();
+        eSetError("'%s' was truncated, stopped following", editorInfo.filenameTrunc);
+        needsRedraw = true;
+        return;
+    }
 
-        eSetStatus("New file '%s'", filename);
-        editorInfo.dirty = 0;
+    if (st.st_size == follow.offset) {
         return;
     }
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        die("fopen");
+    bool atEnd = editorInfo.cy >= editorInfo.linecount - 1;
+
+    char chunk[STREAM_CHUNK];
+    ssize_t n;
+    while (follow.offset < st.st_size && (n = pread(follow.fd, chunk, sizeof(chunk), follow.offset)) > 0) {
+        eFollowAppend(chunk, n);
+        follow.offset += n;
+    }
+    editorInfo.fileSize = follow.offset;
+    editorInfo.fileMtime = eStatMtime(&st);
+
+    if (atEnd && editorInfo.linecount > 0) {
+        editorInfo.cy = editorInfo.linecount - 1;
+        editorInfo.cx = 0;
+    }
+
+    needsRedraw = true;
+}
+
+void *eSaveThread(void *arg) {
+    esavejob *job = (esavejob*)arg;
+
+    job->result = eWriteFile(job->filename, job->lines, job->count, &job->written);
+    job->err = errno;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+//Frees everything the editor let go of while the writer ran and reports the result.
+void eSaveFinish() {
+    saveJob.active = false;
+
+    for (int i = 0; i < saveJob.orphanCount; ++i) {
+        free(saveJob.orphans[i]);
+    }
+    saveJob.orphanCount = 0;
+
+    if (saveJob.result == -1) {
+        eSetError("Can't save! I/O error: %s", strerror(saveJob.err));
+    } else {
+        eSetStatus("%lld bytes written to disk", saveJob.result);
+
+        //Only clear dirty if nothing changed after the snapshot was taken.
+        struct stat st;
+        if (editorInfo.filename && strcmp(editorInfo.filename, saveJob.filename) == 0) {
+            editorInfo.fileSize = saveJob.result;
+            editorInfo.fileMtime = stat(editorInfo.filename, &st) == 0 ? eStatMtime(&st) : 0;
+            editorInfo.diskChanged = false;
+            if (editorInfo.dirty == saveJob.dirty) {
+                editorInfo.dirty = 0;
+                editorInfo.undo.savedCount = saveJob.undoCount;
+            }
+        }
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, file)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            --linelen;
+    for (int i = 0; i < saveJob.count; ++i) {
+        if (saveJob.lines[i].zblock) {
+            eZBlockRelease(saveJob.lines[i].zblock);
         }
+    }
+
+    free(saveJob.filename);
+    free(saveJob.lines);
+    saveJob.filename = NULL;
+    saveJob.lines = NULL;
+    needsRedraw = true;
+}
+
+void eSaveWait() {
+    if (saveJob.active) {
+        pthread_join(saveJob.thread, NULL);
+        eSaveFinish();
+    }
+}
+
+//Called while idle to pick up a finished save and keep the progress shown in the status bar current.
+void eSaveIdle() {
+    if (!saveJob.active) {
+        return;
+    }
 
-        eInsertLine(editorInfo.linecount, line, linelen);
+    if (__atomic_load_n(&saveJob.done, __ATOMIC_ACQUIRE)) {
+        pthread_join(saveJob.thread, NULL);
+        eSaveFinish();
+    } else {
+        needsRedraw = true;
     }
+}
 
-    free(line);
-    fclose(file);
+int eSaveProgress() {
+    if (!saveJob.active || saveJob.total == 0) {
+        return 0;
+    }
 
-    editorInfo.dirty = 0;
+    return (int)(__atomic_load_n(&saveJob.written, __ATOMIC_RELAXED) * 100 / saveJob.total);
 }
 
 void eSave() {
+    if (view.active) {
+        eSetError("'%s' is open read-only", editorInfo.filenameTrunc);
+        return;
+    }
+
+    //The save replaces the file, and the watch would be left on the old one.
+    if (follow.active) {
+        eSetError("Can't write while following, :set nofollow first");
+        return;
+    }
+
     if (editorInfo.filename == NULL) {
         editorInfo.filename = ePrompt("Write as: %s", NULL);
 
@@ -1139,26 +5811,41 @@ void eSave() {
         eSelectSyntaxHL();
     }
 
-    int len;
-    char *buf = eLinesToStr(&len);
+    eSaveWait();
+
+    //Taking the snapshot is just grabbing the line pointers. Bumping snapshotSeq makes every existing line copy on write.
+    saveJob.filename = strdup(editorInfo.filename);
+    saveJob.count = editorInfo.linecount;
+    saveJob.undoCount = editorInfo.undo.count;
+    editorInfo.undo.open = false;
+    saveJob.lines = (esaveline*)malloc(sizeof(esaveline) * (saveJob.count + 1));
+    saveJob.total = 0;
+    for (int i = 0; i < saveJob.count; ++i) {
+        eline *line = &editorInfo.line[i];
+        esaveline *sl = &saveJob.lines[i];
+        sl->data = line->data;
+        sl->size = line->size;
+        sl->zblock = line->zblock;
+        sl->zoff = line->zoff;
+        if (sl->zblock) {
+            ++sl->zblock->refs;
+        }
+        saveJob.total += sl->size + 1;
+    }
 
-    int fd = open(editorInfo.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                eSetStatus("%d bytes written to disk", len);
-                editorInfo.dirty = 0;
+    saveJob.written = 0;
+    saveJob.done = 0;
+    saveJob.dirty = editorInfo.dirty;
+    saveJob.active = true;
+    ++editorInfo.snapshotSeq;
 
-                return;
-            }
-        }
-        close(fd);
+    if (pthread_create(&saveJob.thread, NULL, eSaveThread, &saveJob) != 0) {
+        eSaveThread(&saveJob);
+        eSaveFinish();
+        return;
     }
 
-    free(buf);
-    eSetStatus("Can't save! I/O error: %s", strerror(errno));
+    eSetStatus("Saving %s...", editorInfo.filenameTrunc);
 }
 
 void eFindCallback(char *q, int key) {
@@ -1169,9 +5856,11 @@ void eFindCallback(char *q, int key) {
     static char *savedHL = NULL;
 
     if (savedHL) {
+        eLineReady(&editorInfo.line[savedHLLine]);
         memcpy(editorInfo.line[savedHLLine].hl, savedHL, editorInfo.line[savedHLLine].rsize);
         free(savedHL);
         savedHL = NULL;
+        ++editorInfo.generation;
     }
 
     if (key == vk_enter || key == vk_escape) {
@@ -1190,53 +5879,502 @@ void eFindCallback(char *q, int key) {
     if (lastMatch == -1) {
         direction = 1;
     }
-    int current = lastMatch;
+    int current = lastMatch;
+    bool useIndex = eTrigramReady() && strlen(q) >= 3;
+
+    for (int i = 0; i < editorInfo.linecount; ++i) {
+        if (useIndex) {
+            current = eTrigramFind(q, current, direction);
+            if (current == -1) {
+                break;
+            }
+        } else {
+            current += direction;
+            if (current == -1) {
+                current = editorInfo.linecount - 1;
+            } else if (current == editorInfo.linecount) {
+                current = 0;
+            }
+        }
+
+        eline *line = &editorInfo.line[current];
+        int rsize;
+        char *rdata = eLineRenderTemp(line, &rsize);
+        char *match = strstr(rdata, q);
+
+        if (match) {
+            eLineReady(line);
+            match = &line->rdata[match - rdata];
+            lastMatch = current;
+            editorInfo.cy = current;
+            editorInfo.cx = eRxToCx(line, (int)(match - line->rdata));
+            editorInfo.yoffset = editorInfo.linecount;
+
+            savedHLLine = current;
+            savedHL = (char*)malloc(line->rsize);
+            memcpy(savedHL, line->hl, line->rsize);
+            memset(&line->hl[match - line->rdata], HLMatch, strlen(q));
+            ++editorInfo.generation;
+            break;
+        }
+    }
+}
+
+void eFind() {
+    int savedCx = editorInfo.cx;
+    int savedCy = editorInfo.cy;
+    int savedXOffset = editorInfo.xoffset;
+    int savedYOffset = editorInfo.yoffset;
+
+    char *q = ePrompt("Search: %s", eFindCallback);
+
+    if (q != NULL) {
+        free(q);
+    } else {
+        editorInfo.cx = savedCx;
+        editorInfo.cy = savedCy;
+        editorInfo.xoffset = savedXOffset;
+        editorInfo.yoffset = savedYOffset;
+    }
+}
+
+//Parses a single line address (N, '.' or '$') and returns it 0 based, or -1 if there is none.
+int eParseLineAddr(char **p) {
+    if (**p == '.') {
+        ++*p;
+        return editorInfo.cy;
+    } else if (**p == '$') {
+        ++*p;
+        return editorInfo.linecount - 1;
+    } else if (isdigit(**p)) {
+        int n = (int)strtol(*p, p, 10);
+        return n > 0 ? n - 1 : 0;
+    }
+
+    return -1;
+}
+
+//Copies a substitute pattern or replacement up to the next unescaped delimiter. Returns the length or -1.
+int eParseSubPart(char **p, char delim, char *out) {
+    int len = 0;
+    while (**p && **p != delim) {
+        char c = **p;
+        if (c == '\\' && (*p)[1] != '\0') {
+            ++*p;
+            c = **p;
+            if (c == 't') {
+                c = '\t';
+            } else if (c != delim) {
+                out[len++] = '\\';
+            }
+        }
+
+        out[len++] = c;
+        ++*p;
+    }
+    out[len] = '\0';
+
+    if (**p == delim) {
+        ++*p;
+    }
+
+    return len;
+}
+
+//Parses an optional [range] in front of a command, defaulting to the cursor line. Returns false if it's malformed.
+bool eParseRange(char **p, int *start, int *end) {
+    if (**p == '%') {
+        ++*p;
+        *start = 0;
+        *end = editorInfo.linecount - 1;
+        return true;
+    }
+
+    *start = *end = eParseLineAddr(p);
+    if (*start != -1 && **p == ',') {
+        ++*p;
+        *end = eParseLineAddr(p);
+        return *end != -1;
+    } else if (*start == -1) {
+        *start = *end = editorInfo.cy;
+    }
+
+    return true;
+}
+
+//Copies count lines from at into the register.
+void eYankLines(int at, int count) {
+    if (at + count > editorInfo.linecount) {
+        count = editorInfo.linecount - at;
+    }
+    if (at < 0 || count <= 0) {
+        return;
+    }
+
+    reg.len = eLinesText(at, count, &reg.text, 0, &reg.cap);
+    reg.count = count;
+}
+
+//Pastes the register times times before line at, and leaves the cursor on the first pasted line.
+void ePutLines(int at, int times) {
+    if (reg.count == 0) {
+        eSetError("Nothing to paste");
+        return;
+    }
+
+    //One insert keeps it to a single splice and a single undo record however many copies there are.
+    if (times == 1) {
+        eInsertLinesText(at, reg.text, reg.len, reg.count);
+    } else {
+        if ((long long)reg.len * times > INT_MAX || (long long)reg.count * times > INT_MAX) {
+            eSetError("Too much to paste");
+            return;
+        }
+
+        char *text = (char*)malloc((size_t)reg.len * times);
+        for (int i = 0; i < times; ++i) {
+            memcpy(text + (size_t)reg.len * i, reg.text, reg.len);
+        }
+        eInsertLinesText(at, text, reg.len * times, reg.count * times);
+        free(text);
+    }
+    editorInfo.cy = at;
+    editorInfo.cx = 0;
+}
+
+//Moves the lines [start, end] to just below line dest, or to the top if dest is -1.
+void eMoveLines(int start, int end, int dest) {
+    if (dest >= start && dest < end) {
+        eSetError("Can't move lines into themselves");
+        return;
+    }
+
+    int count = end - start + 1;
+    if (dest > end) {
+        eRotateLines(start, dest - start + 1, count);
+        dest -= count;
+    } else if (dest < start - 1) {
+        eRotateLines(dest + 1, end - dest, start - dest - 1);
+    } else {
+        dest = start - 1;
+    }
+
+    editorInfo.cy = dest + count;
+    editorInfo.cx = 0;
+}
+
+//Handles :[range]m addr. Returns false if cmd isn't a move command.
+bool eMoveCmd(char *cmd) {
+    char *p = cmd;
+    int start, end;
+    if (!eParseRange(&p, &start, &end) || *p != 'm' || (p[1] != ' ' && !isdigit(p[1]) && p[1] != '$' && p[1] != '.')) {
+        return false;
+    }
+
+    ++p;
+    while (*p == ' ') {
+        ++p;
+    }
+
+    //Unlike the other addresses, 0 means above the first line here.
+    int dest = -1;
+    if ((*p != '0' || isdigit(p[1])) && (dest = eParseLineAddr(&p)) == -1) {
+        eSetError("Bad move address '%s'", cmd);
+        return true;
+    } else if (view.active) {
+        eSetError("'%s' is open read-only", editorInfo.filenameTrunc);
+        return true;
+    }
+
+    if (start > end) {
+        int tmp = start;
+        start = end;
+        end = tmp;
+    }
+    if (end >= editorInfo.linecount || dest >= editorInfo.linecount) {
+        eSetError("Line out of range");
+        return true;
+    }
+
+    eMoveLines(start, end, dest);
+    return true;
+}
+
+//Handles counts and the two-key line commands in CMD mode. Returns false if the key is left for the caller.
+bool eLineOpKey(int k) {
+    if (isdigit(k) && (k != '0' || keyCount > 0)) {
+        keyCount = keyCount * 10 + (k - '0');
+        if (keyCount > 1000000) {
+            keyCount = 1000000;
+        }
+        return true;
+    }
+
+    int n = keyCount > 0 ? keyCount : 1;
+    int op = keyOp;
+    keyOp = 0;
+    if (op == 0 && k != 'd' && k != 'y' && k != 'p' && k != 'P') {
+        keyCount = 0;
+        return false;
+    }
+
+    keyCount = 0;
+    if (view.active && k != 'y') {
+        eSetError("'%s' is open read-only", editorInfo.filenameTrunc);
+    } else if (op == 0 && (k == 'd' || k == 'y')) {
+        keyOp = k;
+        keyCount = n > 1 ? n : 0;
+    } else if (op != k) {
+        eSetError("Unknown command '%c%c'", (char)op, (char)k);
+    } else if (editorInfo.cy >= editorInfo.linecount) {
+        //Nothing below the last line to take.
+    } else if (op == 'y') {
+        eYankLines(editorInfo.cy, n);
+        eSetStatus("%d line%s yanked", reg.count, reg.count == 1 ? "" : "s");
+    } else if (op == 'd') {
+        eYankLines(editorInfo.cy, n);
+        eDeleteLines(editorInfo.cy, n);
+        if (editorInfo.cy >= editorInfo.linecount) {
+            editorInfo.cy = editorInfo.linecount > 0 ? editorInfo.linecount - 1 : 0;
+        }
+        editorInfo.cx = 0;
+    }
+
+    if (op == 0 && (k == 'p' || k == 'P') && !view.active) {
+        int at = editorInfo.cy + (k == 'p' && editorInfo.cy < editorInfo.linecount);
+        ePutLines(at, n);
+    }
+
+    return true;
+}
+
+//Replays a macro times times. Its keys go through the usual dispatch, but inside the transaction of the key that
+//started it, so nothing is drawn or highlighted until the end.
+void eMacroRun(int r, int times) {
+    emacro *m = &macros[r];
+    if (m->len == 0) {
+        eSetError("Register '%c' is empty", 'a' + r);
+        return;
+    } else if (replay.depth >= MACRO_MAX_DEPTH) {
+        eSetError("Macros nested too deep");
+        return;
+    }
+
+    //The register could be recorded over while it runs.
+    int *keys = (int*)malloc(sizeof(int) * m->len);
+    memcpy(keys, m->keys, sizeof(int) * m->len);
+
+    ereplay saved = replay;
+    replay.keys = keys;
+    replay.len = m->len;
+    replay.pos = 0;
+    replay.times = times;
+    replay.depth = saved.depth + 1;
+    replay.failed = false;
+    while (!replay.failed && (replay.pos < replay.len || replay.times > 1)) {
+        eTickKey(eReadKey());
+    }
+
+    bool failed = replay.failed;
+    free(keys);
+    replay = saved;
+    replay.failed = replay.failed || (failed && replay.depth > 0);
+}
+
+//Handles q<reg>, q and [N]@<reg> in CMD mode. Returns false if the key is left for the caller.
+bool eMacroKey(int k) {
+    if (keyOp == 'q' || keyOp == '@') {
+        int op = keyOp;
+        int n = keyCount > 0 ? keyCount : 1;
+        keyOp = keyCount = 0;
+        if (op == '@' && k == '@' && lastMacro >= 0) {
+            k = 'a' + lastMacro;
+        }
+
+        if (k < 'a' || k > 'z') {
+            eSetError("Unknown register '%c'", (char)k);
+        } else if (op == 'q') {
+            recording = k - 'a';
+            macros[recording].len = 0;
+        } else {
+            lastMacro = k - 'a';
+            eMacroRun(k - 'a', n);
+        }
+        return true;
+    } else if (keyOp != 0 || (k != 'q' && k != '@')) {
+        return false;
+    }
 
-    for (int i = 0; i < editorInfo.linecount; ++i) {
-        current += direction;
-        if (current == -1) {
-            current = editorInfo.linecount - 1;
-        } else if (current == editorInfo.linecount) {
-            current = 0;
+    if (k == 'q' && recording >= 0) {
+        //The q that stops it was recorded too.
+        if (replay.depth == 0 && macros[recording].len > 0) {
+            --macros[recording].len;
         }
+        recording = -1;
+        keyCount = 0;
+    } else {
+        keyOp = k;
+        keyCount = k == 'q' ? 0 : keyCount;
+    }
 
-        eline *line = &editorInfo.line[current];
-        char *match = strstr(line->rdata, q);
+    return true;
+}
 
-        if (match) {
-            lastMatch = current;
-            editorInfo.cy = current;
-            editorInfo.cx = eRxToCx(line, (int)(match - line->rdata));
-            editorInfo.yoffset = editorInfo.linecount;
+//Appends a substitute's replacement for match m, where & is the whole match and \1 to \9 are its groups.
+void eSubstituteExpand(abuf *ab, const char *repl, int repllen, const char *s, regmatch_t *m) {
+    for (int i = 0; i < repllen; ++i) {
+        int group = -1;
+        if (repl[i] == '&') {
+            group = 0;
+        } else if (repl[i] == '\\' && i + 1 < repllen && repl[i + 1] >= '0' && repl[i + 1] <= '9') {
+            group = repl[++i] - '0';
+        } else if (repl[i] == '\\' && i + 1 < repllen) {
+            ++i;
+        }
 
-            savedHLLine = current;
-            savedHL = (char*)malloc(line->rsize);
-            memcpy(savedHL, line->hl, line->rsize);
-            memset(&line->hl[match - line->rdata], HLMatch, strlen(q));
-            break;
+        if (group == -1) {
+            abAppend(ab, &repl[i], 1);
+        } else if (m[group].rm_so != -1) {
+            abAppend(ab, s + m[group].rm_so, (int)(m[group].rm_eo - m[group].rm_so));
         }
     }
 }
 
-void eFind() {
-    int savedCx = editorInfo.cx;
-    int savedCy = editorInfo.cy;
-    int savedXOffset = editorInfo.xoffset;
-    int savedYOffset = editorInfo.yoffset;
+//Handles :[range]s/pat/repl/[g]. pat is a POSIX basic regular expression, like sed's. Returns false if cmd isn't a
+//substitute command.
+bool eSubstitute(char *cmd) {
+    char *p = cmd;
+    int start, end;
+    if (!eParseRange(&p, &start, &end)) {
+        return false;
+    }
 
-    char *q = ePrompt("Search: %s", eFindCallback);
+    if (*p != 's' || p[1] == '\0' || isalnum(p[1]) || isspace(p[1])) {
+        return false;
+    }
+    ++p;
 
-    if (q != NULL) {
-        free(q);
+    if (view.active) {
+        eSetError("'%s' is open read-only", editorInfo.filenameTrunc);
+        return true;
+    }
+
+    char delim = *p++;
+    int cmdlen = (int)strlen(p);
+    char *pat = (char*)malloc(cmdlen + 1);
+    char *repl = (char*)malloc(cmdlen + 1);
+    int patlen = eParseSubPart(&p, delim, pat);
+    int repllen = eParseSubPart(&p, delim, repl);
+    bool global = strchr(p, 'g') != NULL;
+
+    if (start > end) {
+        int tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    if (end >= editorInfo.linecount) {
+        end = editorInfo.linecount - 1;
+    }
+
+    regex_t re;
+    int err = patlen > 0 ? regcomp(&re, pat, 0) : 0;
+    if (patlen == 0) {
+        eSetError("Empty pattern");
+    } else if (err != 0) {
+        char msg[64];
+        regerror(err, &re, msg, sizeof(msg));
+        eSetError("Bad pattern: %s", msg);
+    } else if (start < 0 || start > end) {
+        eSetError("Invalid range");
     } else {
-        editorInfo.cx = savedCx;
-        editorInfo.cy = savedCy;
-        editorInfo.xoffset = savedXOffset;
-        editorInfo.yoffset = savedYOffset;
+        abuf ab = ABUF_INIT;
+        int subs = 0;
+        int lines = 0;
+        int first = -1;
+        int last = -1;
+
+        for (int i = start; i <= end; ++i) {
+            eline *line = &editorInfo.line[i];
+            if (regexec(&re, eLineDataTemp(line), 0, NULL, 0) != 0) {
+                continue;
+            }
+
+            //Build the new line in one go and only then swap it in.
+            eLineOwn(line);
+            char *s = line->data;
+            regmatch_t m[10];
+            int flags = 0;
+            ab.len = 0;
+            bool adjacent = false;
+            while (regexec(&re, s, 10, m, flags) == 0) {
+                //Like sed, an empty match right where the last one ended doesn't count.
+                bool empty = m[0].rm_eo == m[0].rm_so;
+                if (!(empty && adjacent && m[0].rm_so == 0)) {
+                    abAppend(&ab, s, (int)m[0].rm_so);
+                    eSubstituteExpand(&ab, repl, repllen, s, m);
+                    ++subs;
+                }
+                s += m[0].rm_eo;
+                adjacent = !empty;
+
+                //An empty match would be found again in the same place, so step over a character.
+                if (empty) {
+                    if (*s == '\0') {
+                        break;
+                    }
+                    abAppend(&ab, s++, 1);
+                }
+
+                if (!global) {
+                    break;
+                }
+                flags = REG_NOTBOL;
+            }
+            abAppend(&ab, s, line->size - (int)(s - line->data));
+
+            eUndoRecord(UndoDelText, i, 0, line->data, line->size);
+            eUndoRecord(UndoInsText, i, 0, ab.b, ab.len);
+            line->data = (char*)realloc(line->data, ab.len + 1);
+            memcpy(line->data, ab.b, ab.len);
+            line->size = ab.len;
+            line->data[line->size] = '\0';
+            eUpdateRender(line);
+
+            ++lines;
+            if (first == -1) {
+                first = i;
+            }
+            last = i;
+        }
+        abFree(&ab);
+
+        if (subs == 0) {
+            eSetError("Pattern not found: %s", pat);
+        } else {
+            eUpdateSyntaxRange(first, last + 1);
+            editorInfo.dirty += subs;
+            editorInfo.cy = last;
+            if (editorInfo.cx > editorInfo.line[last].size) {
+                editorInfo.cx = editorInfo.line[last].size;
+            }
+            editorInfo.tx = editorInfo.cx;
+            eSetStatus("%d substitution%s on %d line%s", subs, subs == 1 ? "" : "s", lines, lines == 1 ? "" : "s");
+        }
+    }
+
+    if (patlen > 0 && err == 0) {
+        regfree(&re);
     }
+    free(pat);
+    free(repl);
+
+    return true;
 }
 
 void eScroll() {
+    eViewScroll();
+
     editorInfo.rx = editorInfo.cx;
     if (editorInfo.cy < editorInfo.linecount) {
         editorInfo.rx = eCxToRx(&editorInfo.line[editorInfo.cy], editorInfo.cx);
@@ -1270,12 +6408,13 @@ void eSetMatchColor(abuf *ab) {
     abAppend(ab, "\x1b[38;5;235m", 11); //set foreground color x1b[38;5;[]m replace [] with the color
 }
 
-void eAddLineNumber(abuf *ab, int line) {
+//A line of -1 means its number isn't known yet.
+void eAddLineNumber(abuf *ab, long long line) {
     abAppend(ab, "\x1b[48;5;232m", 11); //set background color x1b[48;5;[]m replace [] with the color
     abAppend(ab, "\x1b[38;5;240m", 11); //set foreground color x1b[38;5;[]m replace [] with the color
 
-    char *num = calloc(editorInfo.maxLineLen, sizeof(char*));
-    int lineLen = sprintf(num, "%d", line + 1);
+    char num[24];
+    int lineLen = line < 0 ? 0 : snprintf(num, sizeof(num), "%lld", line + 1);
     for (int i = 0; i < editorInfo.maxLineLen - lineLen; ++i) {
         abAppend(ab, " ", 1);
     }
@@ -1283,8 +6422,6 @@ void eAddLineNumber(abuf *ab, int line) {
     abAppend(ab, " ", 1);
 
     eSetDefaultTextColor(ab);
-
-    free(num);
 }
 
 void eAddWelcomeMessage(abuf *ab, const char *msg, ...) {
@@ -1311,13 +6448,39 @@ void eAddWelcomeMessage(abuf *ab, const char *msg, ...) {
     abAppend(ab, "\r\n", 2);
 }
 
+//Screen column of the next extra cursor on a line, or -1 once there are none left. Cursors left of the screen are
+//skipped.
+int eNextCursorRx(int *cur, int fileline) {
+    for (; *cur < editorInfo.cursorCount && editorInfo.cursors[*cur].cy == fileline; ++*cur) {
+        eline *line = &editorInfo.line[fileline];
+        int cx = editorInfo.cursors[*cur].cx;
+        int rx = eCxToRx(line, cx > line->size ? line->size : cx) - editorInfo.xoffset;
+        if (rx >= 0) {
+            ++*cur;
+            return rx;
+        }
+    }
+
+    return -1;
+}
+
 void eDrawLines(abuf *ab) {
+    //The bracket under the cursor and its match are underlined.
+    int matchY = -1, matchRx = -1;
+    bool matched = editorInfo.cy < editorInfo.linecount && eBracketMatch(editorInfo.cy, editorInfo.rx, &matchY, &matchRx, false);
+
     for (int y = 0; y < editorInfo.h; ++y) {
         eSetDefaultTextColor(ab);
 
+        //A window can't clear to the end of the screen line without clearing its neighbour too.
+        if (drawWindowed) {
+            char erase[16];
+            abAppend(ab, erase, snprintf(erase, sizeof(erase), "\x1b[%dX", editorInfo.w));
+        }
+
         int fileline = y + editorInfo.yoffset;
         if (fileline >= editorInfo.linecount) {
-            if (editorInfo.linecount == 0 && y == editorInfo.h / 4) {
+            if (editorInfo.linecount == 0 && y == editorInfo.h / 4 && !drawWindowed) {
                 eAddWelcomeMessage(ab, "shabi version %s", SHABI_VER);
                 eAddWelcomeMessage(ab, " ");
                 eAddWelcomeMessage(ab, "type :help for help");
@@ -1328,6 +6491,7 @@ void eDrawLines(abuf *ab) {
                 abAppend(ab, "~", 1);
             }
         } else {
+            eLineReady(&editorInfo.line[fileline]);
             int len = editorInfo.line[fileline].rsize - editorInfo.xoffset;
             len = len < 0 ? 0 : len;
 
@@ -1336,13 +6500,26 @@ void eDrawLines(abuf *ab) {
             }
 
             if (editorInfo.showLineNumbers) {
-                eAddLineNumber(ab, fileline);
+                eAddLineNumber(ab, eLineNumber(fileline));
             }
 
             char *c = &editorInfo.line[fileline].rdata[editorInfo.xoffset];
             unsigned char *hl = &editorInfo.line[fileline].hl[editorInfo.xoffset];
             int currentColor = -1;
+
+            //Extra cursors show up as reversed cells.
+            int cur = eCursorFirst(fileline);
+            int curRx = eNextCursorRx(&cur, fileline);
+            int brRx = matched && fileline == editorInfo.cy ? editorInfo.rx - editorInfo.xoffset : -1;
+            int matchAt = matched && fileline == matchY ? matchRx - editorInfo.xoffset : -1;
             for (int i = 0; i < len; ++i) {
+                if (i == curRx) {
+                    abAppend(ab, "\x1b[7m", 4);
+                }
+                if (i == brRx || i == matchAt) {
+                    abAppend(ab, "\x1b[4m", 4);
+                }
+
                 if (iscntrl(c[i])) {
                     char sym = (char)((c[i] <= 26) ? '@' + c[i] : '?');
                     abAppend(ab, "\x1b[7m", 4);
@@ -1373,12 +6550,27 @@ void eDrawLines(abuf *ab) {
                     }
                     abAppend(ab, &c[i], 1);
                 }
+
+                if (i == brRx || i == matchAt) {
+                    abAppend(ab, "\x1b[24m", 5);
+                }
+                if (i == curRx) {
+                    abAppend(ab, "\x1b[27m", 5);
+                    do {
+                        curRx = eNextCursorRx(&cur, fileline);
+                    } while (curRx != -1 && curRx <= i);
+                }
             }
 
+            if (curRx >= len && curRx < eWidth()) {
+                abAppend(ab, "\x1b[7m \x1b[27m", 10);
+            }
             eSetDefaultTextColor(ab);
         }
 
-        abAppend(ab, "\x1b[K", 3);
+        if (!drawWindowed) {
+            abAppend(ab, "\x1b[K", 3);
+        }
         abAppend(ab, "\r\n", 2);
     }
 }
@@ -1401,11 +6593,40 @@ void eDrawStatusBar(abuf *ab) {
         eSetCMDColor(ab);
     }
 
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), " %s %.20s %s ", editorInfo.mode ? "EDIT" : "CMND",
-                       editorInfo.filename ? editorInfo.filename : "[empty]", editorInfo.dirty ? "[+]" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), " %s | %d/%d:%d", editorInfo.syntax ? editorInfo.syntax->filetype : "",
+    char status[80], rstatus[80], saving[32] = "";
+    if (saveJob.active) {
+        snprintf(saving, sizeof(saving), "saving %d%% ", eSaveProgress());
+    } else if (stream.active) {
+        snprintf(saving, sizeof(saving), "reading %lldK ", stream.bytes / 1024);
+    } else if (view.active && !view.done) {
+        snprintf(saving, sizeof(saving), "indexing %d%% ", (int)(view.size ? view.scanned * 100 / view.size : 100));
+    } else if (recording >= 0) {
+        snprintf(saving, sizeof(saving), "recording @%c ", 'a' + recording);
+    }
+
+    char *name = editorInfo.filename;
+    if (name == NULL) {
+        name = stream.active ? (stream.path ? stream.path : "[stdin]") : "[empty]";
+    }
+
+    int len = snprintf(status, sizeof(status), " %s %.20s %s %s", editorInfo.mode ? "EDIT" : "CMND",
+                       name, editorInfo.dirty ? "[+]" : "", saving);
+    int rlen;
+    if (view.active) {
+        //Line numbers are unknown until the index has caught up.
+        char cur[24] = "?", total[24] = "?";
+        if (eLineNumber(editorInfo.cy) >= 0) {
+            snprintf(cur, sizeof(cur), "%lld", eLineNumber(editorInfo.cy) + 1);
+        }
+        if (view.done) {
+            snprintf(total, sizeof(total), "%lld", view.total);
+        }
+        rlen = snprintf(rstatus, sizeof(rstatus), " %s | %s/%s:%d", editorInfo.syntax ? editorInfo.syntax->filetype : "",
+                        cur, total, editorInfo.cx);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus), " %s | %d/%d:%d", editorInfo.syntax ? editorInfo.syntax->filetype : "",
                         editorInfo.cy + 1, editorInfo.linecount, editorInfo.cx);
+    }
 
     if (len > editorInfo.w) {
         len = editorInfo.w;
@@ -1450,43 +6671,664 @@ void eDrawMsgBar(abuf *ab) {
             abAppend(ab, colorStr, len);
         }
 
-        abAppend(ab, editorInfo.statusmsg, msglen);
-        eSetDefaultTextColor(ab);
-    } else {
-        if (firstMessage) {
-            firstMessage = false;
+        abAppend(ab, editorInfo.statusmsg, msglen);
+        eSetDefaultTextColor(ab);
+    } else {
+        if (firstMessage) {
+            firstMessage = false;
+        }
+
+        editorInfo.statuserror = false;
+    }
+}
+
+void *eRenderThread(void *arg) {
+    erender *r = (erender*)arg;
+
+    pthread_mutex_lock(&r->lock);
+    while (true) {
+        while (r->frame == NULL) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+
+        char *frame = r->frame;
+        int len = r->len;
+        r->frame = NULL;
+        r->writing = true;
+        pthread_mutex_unlock(&r->lock);
+
+        //A terminal that's gone only loses frames. Reading input notices it.
+        int off = 0;
+        while (off < len) {
+            ssize_t n = write(STDOUT_FILENO, frame + off, len - off);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                break;
+            }
+            off += (int)n;
+        }
+        free(frame);
+
+        pthread_mutex_lock(&r->lock);
+        r->writing = false;
+        pthread_cond_broadcast(&r->cond);
+    }
+
+    return NULL;
+}
+
+void eRenderStart() {
+    render.active = true;
+    eStartThread(&render.thread, eRenderThread, &render);
+}
+
+//Hands a frame over to the render thread. A full frame drops the one before it if that hasn't started being written yet,
+//while one that only redraws some rows has to go after it.
+void eRenderSubmit(char *frame, int len, bool full) {
+    if (!render.active) {
+        write(STDOUT_FILENO, frame, len);
+        free(frame);
+        return;
+    }
+
+    pthread_mutex_lock(&render.lock);
+    if (full || render.frame == NULL) {
+        free(render.frame);
+        render.frame = frame;
+        render.len = len;
+    } else {
+        render.frame = (char*)realloc(render.frame, render.len + len);
+        memcpy(render.frame + render.len, frame, len);
+        render.len += len;
+        free(frame);
+    }
+    pthread_cond_broadcast(&render.cond);
+    pthread_mutex_unlock(&render.lock);
+}
+
+//Waits for every frame handed over so far to be written, before anything else writes to the terminal.
+void eRenderFlush() {
+    if (!render.active || pthread_equal(pthread_self(), render.thread)) {
+        return;
+    }
+
+    pthread_mutex_lock(&render.lock);
+    while (render.frame != NULL || render.writing) {
+        pthread_cond_wait(&render.cond, &render.lock);
+    }
+    pthread_mutex_unlock(&render.lock);
+}
+
+//Draws the text and status bar of a single window and writes the rows that differ from what the client has. Returns
+//whether every row was written.
+bool eScreenDraw(abuf *ab) {
+    eScroll();
+
+    int rows = editorInfo.h + 1;
+    bool full = screen.full || screen.rowCount != rows;
+    if (screen.rowCount != rows) {
+        for (int r = 0; r < screen.rowCount; ++r) {
+            abFree(&screen.rows[r]);
+        }
+        free(screen.rows);
+        screen.rows = (abuf*)calloc(rows, sizeof(abuf));
+        screen.rowCount = rows;
+    }
+    screen.full = false;
+
+    abuf frame = ABUF_INIT;
+    eDrawLines(&frame);
+    eDrawStatusBar(&frame);
+
+    char *p = frame.b, *end = frame.b + frame.len;
+    for (int r = 0; r < rows && p < end; ++r) {
+        char *nl = (char*)memchr(p, '\r', end - p);
+        int len = (int)((nl ? nl : end) - p);
+
+        abuf *prev = &screen.rows[r];
+        if (full || prev->len != len || memcmp(prev->b, p, len) != 0) {
+            char pos[32];
+            abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H", r + 1));
+            abAppend(ab, p, len);
+
+            prev->b = (char*)realloc(prev->b, len);
+            memcpy(prev->b, p, len);
+            prev->len = len;
+        }
+
+        p += len + 2;
+    }
+    abFree(&frame);
+
+    char pos[32];
+    abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H", rows + 1));
+    eDrawMsgBar(ab);
+    return full;
+}
+
+void ecls() {
+    //A replaying macro gets one frame, once it's done.
+    if (replay.depth > 0) {
+        return;
+    }
+
+    //Nobody's looking while a server has no client.
+    if (server.listen != -1 && !server.attached) {
+        return;
+    }
+
+    eFlushEdits();
+
+    abuf ab = ABUF_INIT;
+
+    abAppend(&ab, "\x1b[?25l", 6);
+
+    bool full = true;
+    int top = 0, left = 0;
+    if (windows.count > 1) {
+        full = windows.full;
+        eWindowCompose(&ab);
+        top = windows.list[windows.current].top;
+        left = windows.list[windows.current].left;
+        screen.full = true;
+    } else if (server.attached) {
+        full = eScreenDraw(&ab);
+    } else {
+        eScroll();
+        abAppend(&ab, "\x1b[H", 3);
+
+        eDrawLines(&ab);
+        eDrawStatusBar(&ab);
+        eDrawMsgBar(&ab);
+    }
+
+    //Set the cursor position and include the line number area width.
+    int lineNumberWidth = 0;
+    if (editorInfo.linecount > 0) {
+        lineNumberWidth = editorInfo.showLineNumbers ? editorInfo.maxLineLen + 1 : 0;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editorInfo.cy - editorInfo.yoffset) + top + 1, ((editorInfo.rx + lineNumberWidth) - editorInfo.xoffset) + left + 1);
+    abAppend(&ab, buf, (int)strlen(buf));
+    abAppend(&ab, "\x1b[?25h", 6);
+    abAppend(&ab, "\x1b]1337;CursorShape=1\x07", 21); //set cursor to vertical bar, iTerm2 specific
+
+    eRenderSubmit(ab.b, ab.len, full);
+}
+
+//Handles :set <option> and :set no<option>.
+void eSetOption(char *opt) {
+    bool on = true;
+    if (strncmp(opt, "no", 2) == 0) {
+        on = false;
+        opt += 2;
+    }
+
+    if (strncmp(opt, "undocap=", 8) == 0) {
+        //In kilobytes.
+        editorInfo.undo.limit = atoll(&opt[8]) * 1024;
+        eUndoTrim();
+    } else if (strcmp(opt, "trigram") == 0 && on && view.active) {
+        eSetError("Can't keep a trigram index while viewing");
+        return;
+    } else if (strcmp(opt, "trigram") == 0) {
+        editorInfo.useTrigram = on;
+        if (on && editorInfo.trigram == NULL) {
+            eTrigramStart();
+        } else if (!on) {
+            eTrigramFree();
+        }
+    } else if (strcmp(opt, "compress") == 0) {
+        editorInfo.compress = on;
+        editorInfo.zNext = 0;
+    } else if (strcmp(opt, "follow") == 0) {
+        if (!on) {
+            eFollowStop();
+        } else if (!eFollowStart()) {
+            return;
+        }
+    } else if (strcmp(opt, "nu") == 0 || strcmp(opt, "number") == 0) {
+        editorInfo.showLineNumbers = on;
+        ++editorInfo.generation;
+    } else if (strcmp(opt, "truetab") == 0) {
+        editorInfo.useTrueTab = on;
+    } else {
+        eSetError("Unknown option '%s'", opt);
+        return;
+    }
+
+    eSetStatus("%s%s", on ? "" : "no", opt);
+}
+
+//Things that can't be left running in the background. Anything a transaction has touched is finished first.
+bool eBufferCanLeave() {
+    if (stream.active || follow.active || view.active) {
+        eSetError("Can't switch buffers while %s", stream.active ? "reading" : follow.active ? "following" : "viewing");
+        return false;
+    }
+
+    eSaveWait();
+    eFlushEdits();
+    if (buffers.count == 0) {
+        buffers.cap = 4;
+        buffers.list = (struct editorInfo*)malloc(sizeof(struct editorInfo) * buffers.cap);
+        buffers.count = 1;
+        buffers.current = 0;
+    }
+
+    return true;
+}
+
+//Makes buffer i current. The screen and the options that aren't per buffer stay as they are.
+void eBufferLoad(int i) {
+    struct editorInfo cur = editorInfo;
+    editorInfo = buffers.list[i];
+    buffers.current = i;
+
+    editorInfo.w = cur.w;
+    editorInfo.h = cur.h;
+    editorInfo.origTermios = cur.origTermios;
+    memcpy(editorInfo.statusmsg, cur.statusmsg, sizeof(cur.statusmsg));
+    editorInfo.statusmsgTime = cur.statusmsgTime;
+    editorInfo.statuserror = cur.statuserror;
+    editorInfo.mode = cur.mode;
+    editorInfo.useTrigram = cur.useTrigram;
+    editorInfo.compress = cur.compress;
+}
+
+void eBufferSwitch(int i) {
+    if (i < 0 || i >= (buffers.count ? buffers.count : 1)) {
+        eSetError("No buffer %d", i + 1);
+        return;
+    }
+
+    if (i != buffers.current) {
+        if (!eBufferCanLeave()) {
+            return;
+        }
+        buffers.list[buffers.current] = editorInfo;
+        eBufferLoad(i);
+    }
+
+    eSetStatus("[%d] %s", i + 1, editorInfo.filename ? editorInfo.filename : "[empty]");
+}
+
+//Adds an empty buffer and makes it current.
+bool eBufferNew() {
+    if (!eBufferCanLeave()) {
+        return false;
+    }
+
+    if (buffers.count == buffers.cap) {
+        buffers.cap *= 2;
+        buffers.list = (struct editorInfo*)realloc(buffers.list, sizeof(struct editorInfo) * buffers.cap);
+    }
+    buffers.list[buffers.current] = editorInfo;
+
+    struct editorInfo cur = editorInfo;
+    eInit();
+    buffers.list[buffers.count] = editorInfo;
+    editorInfo = cur;
+    eBufferLoad(buffers.count++);
+    return true;
+}
+
+//Opens a file in a buffer of its own, or switches to it if it's already open. An empty buffer gets reused. Buffers
+//are named by the file's real path, so one file only ever gets one buffer however it's spelled.
+void eBufferOpen(char *filename) {
+    char full[PATH_MAX];
+    if (realpath(filename, full)) {
+        filename = full;
+    }
+
+    for (int i = 0; i < (buffers.count ? buffers.count : 1); ++i) {
+        char *name = i == buffers.current ? editorInfo.filename : buffers.list[i].filename;
+        if (name && strcmp(name, filename) == 0) {
+            eBufferSwitch(i);
+            return;
+        }
+    }
+
+    bool empty = editorInfo.filename == NULL && editorInfo.dirty == 0 && !stream.active && !view.active;
+    if (empty || eBufferNew()) {
+        eOpen(filename);
+    }
+}
+
+//Closes the current buffer and moves to the one before it, or leaves a single empty buffer.
+void eBufferClose(bool force) {
+    if (editorInfo.dirty > 0 && !force) {
+        eSetError("No write since last change (:bd! to override)");
+        return;
+    }
+
+    eSaveWait();
+    eFlushEdits();
+    bool mode = editorInfo.mode;
+    eReset();
+    editorInfo.mode = mode;
+    if (buffers.count <= 1) {
+        return;
+    }
+
+    int i = buffers.current;
+    memmove(&buffers.list[i], &buffers.list[i + 1], sizeof(struct editorInfo) * (buffers.count - i - 1));
+    --buffers.count;
+    eBufferLoad(i > 0 ? i - 1 : 0);
+
+    //Windows that showed it move on too.
+    for (int w = 0; w < windows.count; ++w) {
+        ewindow *win = &windows.list[w];
+        if (win->buffer == i) {
+            win->buffer = buffers.current;
+        } else if (win->buffer > i) {
+            --win->buffer;
+        }
+    }
+}
+
+//Index of a buffer other than the current one with unsaved changes, or -1.
+int eBufferDirty() {
+    for (int i = 0; i < buffers.count; ++i) {
+        if (i != buffers.current && buffers.list[i].dirty > 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+//Lists the buffers on the status line. The current one is marked with a '%', and modified ones with a '+'.
+void eBufferList() {
+    char list[sizeof(editorInfo.statusmsg)];
+    int len = 0;
+    for (int i = 0; i < (buffers.count ? buffers.count : 1) && len < (int)sizeof(list); ++i) {
+        struct editorInfo *b = i == buffers.current ? &editorInfo : &buffers.list[i];
+        char *name = b->filename ? strrchr(b->filename, '/') : NULL;
+        name = name ? name + 1 : b->filename ? b->filename : "[empty]";
+        len += snprintf(&list[len], sizeof(list) - len, "%s%d%s %s%s", i > 0 ? "  " : "", i + 1,
+                        i == buffers.current ? "%" : "", name, b->dirty ? "+" : "");
+    }
+
+    eSetStatus("%s", list);
+}
+
+//Copies the current window's view out of editorInfo.
+void eWindowStore() {
+    ewindow *win = &windows.list[windows.current];
+    win->buffer = buffers.count ? buffers.current : 0;
+    win->cx = editorInfo.cx;
+    win->cy = editorInfo.cy;
+    win->rx = editorInfo.rx;
+    win->tx = editorInfo.tx;
+    win->yoffset = editorInfo.yoffset;
+    win->xoffset = editorInfo.xoffset;
+}
+
+//Puts window i's buffer and view in editorInfo. Another window on the same buffer may have removed lines since.
+void eWindowShow(int i) {
+    ewindow *win = &windows.list[i];
+    if (buffers.count > 0 && win->buffer != buffers.current) {
+        buffers.list[buffers.current] = editorInfo;
+        eBufferLoad(win->buffer);
+    }
+
+    editorInfo.cy = win->cy < editorInfo.linecount ? win->cy : editorInfo.linecount;
+    int size = editorInfo.cy < editorInfo.linecount ? editorInfo.line[editorInfo.cy].size : 0;
+    editorInfo.cx = win->cx < size ? win->cx : size;
+    editorInfo.rx = win->rx;
+    editorInfo.tx = win->tx;
+    editorInfo.yoffset = win->yoffset;
+    editorInfo.xoffset = win->xoffset;
+    editorInfo.w = win->w;
+    editorInfo.h = win->h;
+}
+
+//Makes window i current. Fails if its buffer can't be switched to.
+bool eWindowLoad(int i) {
+    ewindow *win = &windows.list[i];
+    if (buffers.count > 0 && win->buffer != buffers.current && !eBufferCanLeave()) {
+        return false;
+    }
+
+    windows.current = i;
+    eWindowShow(i);
+    return true;
+}
+
+//Works out where each window goes in the area below node, and on full frames draws the bars between side by side ones.
+//h includes the status bar under each window.
+void eWindowLayout(int node, int top, int left, int w, int h, abuf *ab) {
+    esplit *n = &windows.nodes[node];
+    if (n->window >= 0) {
+        ewindow *win = &windows.list[n->window];
+        win->top = top;
+        win->left = left;
+        win->w = w;
+        win->h = h - 1;
+
+        if (win->rowCount != h) {
+            for (int r = 0; r < win->rowCount; ++r) {
+                abFree(&win->rows[r]);
+            }
+            free(win->rows);
+            win->rows = (abuf*)calloc(h, sizeof(abuf));
+            win->rowCount = h;
+            windows.full = true;
+        }
+        return;
+    }
+
+    if (n->vertical) {
+        int lw = (w - 1) / 2;
+        eWindowLayout(n->first, top, left, lw, h, ab);
+        eWindowLayout(n->second, top, left + lw + 1, w - lw - 1, h, ab);
+
+        for (int r = 0; ab && r < h; ++r) {
+            char pos[32];
+            abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;%dH", top + r + 1, left + lw + 1));
+            eSetDefaultTextColor(ab);
+            abAppend(ab, "|", 1);
+        }
+    } else {
+        int th = h / 2;
+        eWindowLayout(n->first, top, left, w, th, ab);
+        eWindowLayout(n->second, top + th, left, w, h - th, ab);
+    }
+}
+
+//Draws window i, text and status bar, and writes the rows that differ from what's on screen.
+void eWindowDraw(int i, abuf *ab) {
+    ewindow *win = &windows.list[i];
+    eWindowShow(i);
+    eScroll();
+
+    //The status bar also shows the mode and whatever's running, so it's the only part drawn every time.
+    eviewkey key = {win->buffer, editorInfo.generation, editorInfo.yoffset, editorInfo.xoffset,
+                    editorInfo.w, editorInfo.h, editorInfo.cy, editorInfo.rx};
+    bool same = !windows.full && memcmp(&key, &win->drawn, sizeof(key)) == 0;
+    win->drawn = key;
+
+    abuf frame = ABUF_INIT;
+    drawWindowed = true;
+    if (!same) {
+        eDrawLines(&frame);
+    }
+    eDrawStatusBar(&frame);
+    drawWindowed = false;
+
+    win->yoffset = editorInfo.yoffset;
+    win->xoffset = editorInfo.xoffset;
+    win->rx = editorInfo.rx;
+
+    //Every row ends in "\r\n", and nothing else in a row is a '\r'.
+    char *p = frame.b, *end = frame.b + frame.len;
+    for (int r = same ? win->h : 0; r < win->rowCount && p < end; ++r) {
+        char *nl = (char*)memchr(p, '\r', end - p);
+        int len = (int)((nl ? nl : end) - p);
+
+        abuf *prev = &win->rows[r];
+        if (windows.full || prev->len != len || memcmp(prev->b, p, len) != 0) {
+            char pos[32];
+            abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;%dH", win->top + r + 1, win->left + 1));
+            abAppend(ab, p, len);
+
+            prev->b = (char*)realloc(prev->b, len);
+            memcpy(prev->b, p, len);
+            prev->len = len;
+        }
+
+        p += len + 2;
+    }
+    abFree(&frame);
+}
+
+//Draws every window into ab, then leaves the current one in editorInfo again.
+void eWindowCompose(abuf *ab) {
+    eWindowStore();
+    eWindowLayout(0, 0, 0, windows.screenW, windows.screenH - 1, windows.full ? ab : NULL);
+
+    int cur = windows.current;
+    for (int i = 0; i < windows.count; ++i) {
+        if (i != cur) {
+            eWindowDraw(i, ab);
         }
+    }
+    eWindowDraw(cur, ab);
+    windows.full = false;
+
+    char pos[32];
+    abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H", windows.screenH));
+    editorInfo.w = windows.screenW;
+    eDrawMsgBar(ab);
+    editorInfo.w = windows.list[cur].w;
+}
 
-        editorInfo.statuserror = false;
+int eWindowNode(int window, int parent) {
+    windows.nodes = (esplit*)realloc(windows.nodes, sizeof(esplit) * (windows.nodeCount + 1));
+    windows.nodes[windows.nodeCount] = (esplit){window, false, -1, -1, parent};
+    return windows.nodeCount++;
+}
+
+//Splits the current window in two, both showing what it did. The new one goes above or to the left and gets the cursor.
+void eWindowSplit(bool vertical) {
+    if (view.active || stream.active) {
+        eSetError("Can't split while %s", view.active ? "viewing" : "reading");
+        return;
     }
+
+    if (windows.count == 0) {
+        windows.list = (ewindow*)calloc(1, sizeof(ewindow));
+        windows.count = 1;
+        windows.current = 0;
+        windows.nodeCount = 0;
+        windows.list[0].node = eWindowNode(0, -1);
+        windows.screenW = editorInfo.w;
+        windows.screenH = editorInfo.h + 2;
+        eWindowLayout(0, 0, 0, windows.screenW, windows.screenH - 1, NULL);
+    }
+    eWindowStore();
+
+    ewindow *win = &windows.list[windows.current];
+    if (vertical ? win->w < 21 : win->h < 3) {
+        eSetError("Not enough room to split");
+        return;
+    }
+
+    int i = windows.count++;
+    windows.list = (ewindow*)realloc(windows.list, sizeof(ewindow) * windows.count);
+    win = &windows.list[windows.current];
+    windows.list[i] = *win;
+    windows.list[i].rows = NULL;
+    windows.list[i].rowCount = 0;
+
+    int node = win->node;
+    int first = eWindowNode(i, node);
+    int second = eWindowNode(windows.current, node);
+    windows.nodes[node] = (esplit){-1, vertical, first, second, windows.nodes[node].parent};
+    windows.list[i].node = first;
+    win->node = second;
+
+    windows.full = true;
+    eWindowLayout(0, 0, 0, windows.screenW, windows.screenH - 1, NULL);
+    eWindowLoad(i);
 }
 
-void ecls() {
-    eScroll();
+//Closes the current window. Its space goes to the window or windows it was split from.
+bool eWindowClose() {
+    if (windows.count <= 1) {
+        return false;
+    }
+    eWindowStore();
 
-    abuf ab = ABUF_INIT;
+    int i = windows.current;
+    int node = windows.list[i].node;
+    int parent = windows.nodes[node].parent;
+    int sibling = windows.nodes[parent].first == node ? windows.nodes[parent].second : windows.nodes[parent].first;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    //The cursor moves to the first window in what's left of the split.
+    int next = sibling;
+    while (windows.nodes[next].window < 0) {
+        next = windows.nodes[next].first;
+    }
+    next = windows.nodes[next].window;
+    if (buffers.count > 0 && windows.list[next].buffer != buffers.current && !eBufferCanLeave()) {
+        return false;
+    }
 
-    eDrawLines(&ab);
-    eDrawStatusBar(&ab);
-    eDrawMsgBar(&ab);
+    esplit moved = windows.nodes[sibling];
+    moved.parent = windows.nodes[parent].parent;
+    windows.nodes[parent] = moved;
+    if (moved.window >= 0) {
+        windows.list[moved.window].node = parent;
+    } else {
+        windows.nodes[moved.first].parent = parent;
+        windows.nodes[moved.second].parent = parent;
+    }
 
-    //Set the cursor position and include the line number area width.
-    int lineNumberWidth = 0;
-    if (editorInfo.linecount > 0) {
-        lineNumberWidth = editorInfo.showLineNumbers ? editorInfo.maxLineLen + 1 : 0;
+    for (int r = 0; r < windows.list[i].rowCount; ++r) {
+        abFree(&windows.list[i].rows[r]);
+    }
+    free(windows.list[i].rows);
+    memmove(&windows.list[i], &windows.list[i + 1], sizeof(ewindow) * (windows.count - i - 1));
+    --windows.count;
+    for (int n = 0; n < windows.nodeCount; ++n) {
+        if (windows.nodes[n].window > i) {
+            --windows.nodes[n].window;
+        }
     }
+    next -= next > i;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editorInfo.cy - editorInfo.yoffset) + 1, ((editorInfo.rx + lineNumberWidth) - editorInfo.xoffset) + 1);
-    abAppend(&ab, buf, (int)strlen(buf));
-    abAppend(&ab, "\x1b[?25h", 6);
-    abAppend(&ab, "\x1b]1337;CursorShape=1\x07", 21); //set cursor to vertical bar, iTerm2 specific
+    windows.current = next;
+    eWindowShow(next);
+
+    //Back to one window, which is drawn the usual way.
+    if (windows.count == 1) {
+        for (int r = 0; r < windows.list[0].rowCount; ++r) {
+            abFree(&windows.list[0].rows[r]);
+        }
+        free(windows.list[0].rows);
+        free(windows.list);
+        free(windows.nodes);
+        editorInfo.w = windows.screenW;
+        editorInfo.h = windows.screenH - 2;
+        memset(&windows, 0, sizeof(windows));
+    } else {
+        windows.full = true;
+        eWindowLayout(0, 0, 0, windows.screenW, windows.screenH - 1, NULL);
+        eWindowShow(next);
+    }
+
+    return true;
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void eWindowNext() {
+    if (windows.count > 1) {
+        eWindowStore();
+        eWindowLoad((windows.current + 1) % windows.count);
+    }
 }
 
 void eCMD() {
@@ -1499,47 +7341,375 @@ void eCMD() {
     //ecmd cmd = parseCMD(cmdStr);
     
     if (strcmp(cmd, "q") == 0) {
-        if (editorInfo.dirty > 0) {
+        if (eWindowClose()) {
+            //Only the window goes.
+        } else if (server.listen != -1) {
+            //Detaching loses nothing, the changes stay in the server for the next client.
+            quit();
+        } else if (editorInfo.dirty > 0) {
             eSetError("No write since last change (:qq to override)");
+        } else if (eBufferDirty() >= 0) {
+            eSetError("No write since last change in buffer %d (:qq to override)", eBufferDirty() + 1);
         } else {
             quit();
         }
     } else if (strcmp(cmd, "q!") == 0 || strcmp(cmd, "qq") == 0) {
         quit();
+    } else if (strcmp(cmd, "qa") == 0 || strcmp(cmd, "qa!") == 0) {
+        //Unlike :q this stops a server too.
+        if (cmd[2] != '!' && (editorInfo.dirty > 0 || eBufferDirty() >= 0)) {
+            eSetError("No write since last change (:qa! to override)");
+        } else {
+            eSaveWait();
+            exit(EXIT_SUCCESS);
+        }
     } else if (strcmp(cmd, "w") == 0) {
         eSave();
     } else if (strcmp(cmd, "wq") == 0) {
         eSave();
-        quit();
+        eSaveWait();
+        if (eBufferDirty() >= 0) {
+            eSetError("No write since last change in buffer %d (:qq to override)", eBufferDirty() + 1);
+        } else if (editorInfo.dirty == 0) {
+            quit();
+        }
     } else if (strcmp(cmd, "help") == 0) {
         eSetStatus("TODO: Add useful help.");
     } else if (strcmp(cmd, "reset") == 0) {
         eReset();
     } else if (cmd[0] == 'o' && cmd[1] == ' ') {
-        if (editorInfo.dirty > 0) {
+        eBufferOpen(&cmd[2]);
+    } else if (cmd[0] == 'o' && (cmd[1] == 'o' || cmd[1] == '!') && cmd[2] == ' ') {
+        eOpen(&cmd[3]);
+    } else if (strspn(cmd, "0123456789") == strlen(cmd)) {
+        eGotoLine(atoll(cmd) - 1);
+    } else if (strcmp(cmd, "$") == 0) {
+        eGotoEnd();
+    } else if (strncmp(cmd, "view ", 5) == 0) {
+        if (windows.count > 1) {
+            eSetError("Can't view a file in a split window");
+        } else if (editorInfo.dirty > 0) {
             eSetError("No write since last change (:oo to override)");
         } else {
-            eOpen(&cmd[2]);
+            eViewOpen(&cmd[5]);
         }
-    } else if (cmd[0] == 'o' && (cmd[1] == 'o' || cmd[1] == '!') && cmd[2] == ' ') {
-        eOpen(&cmd[3]);
-    }else {
+    } else if (strcmp(cmd, "e") == 0) {
+        eReload(false);
+    } else if (strcmp(cmd, "e!") == 0 || strcmp(cmd, "reload") == 0) {
+        eReload(true);
+    } else if (strncmp(cmd, "set ", 4) == 0) {
+        eSetOption(&cmd[4]);
+    } else if (strcmp(cmd, "sp") == 0 || strcmp(cmd, "split") == 0) {
+        eWindowSplit(false);
+    } else if (strcmp(cmd, "vs") == 0 || strcmp(cmd, "vsplit") == 0) {
+        eWindowSplit(true);
+    } else if (strcmp(cmd, "close") == 0) {
+        if (!eWindowClose()) {
+            eSetError("Can't close the last window");
+        }
+    } else if (strcmp(cmd, "ls") == 0) {
+        eBufferList();
+    } else if (cmd[0] == 'b' && cmd[1] == ' ' && cmd[2] && strspn(&cmd[2], "0123456789") == strlen(&cmd[2])) {
+        eBufferSwitch(atoi(&cmd[2]) - 1);
+    } else if (strcmp(cmd, "bn") == 0 || strcmp(cmd, "bp") == 0) {
+        int n = buffers.count ? buffers.count : 1;
+        eBufferSwitch((buffers.current + (cmd[1] == 'n' ? 1 : n - 1)) % n);
+    } else if (strcmp(cmd, "bd") == 0 || strcmp(cmd, "bd!") == 0) {
+        eBufferClose(cmd[2] == '!');
+    } else if (strncmp(cmd, "export ", 7) == 0) {
+        eExport(&cmd[7]);
+    } else if (eMoveCmd(cmd)) {
+        //Handled.
+    } else if (eSubstitute(cmd)) {
+        //Handled.
+    } else {
         eSetError("Unknown command '%s'", cmd);
     }
 }
 
+int eCursorCmp(const void *a, const void *b) {
+    const ecursor *x = (const ecursor*)a, *y = (const ecursor*)b;
+    return x->cy != y->cy ? (x->cy > y->cy) - (x->cy < y->cy) : (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+//Sorts the extra cursors and drops any that landed on each other or on the primary one.
+void eCursorSort() {
+    ++editorInfo.generation;
+    ecursor *c = editorInfo.cursors;
+    qsort(c, editorInfo.cursorCount, sizeof(ecursor), eCursorCmp);
+
+    int n = 0;
+    for (int i = 0; i < editorInfo.cursorCount; ++i) {
+        bool primary = c[i].cy == editorInfo.cy && c[i].cx == editorInfo.cx;
+        if (!primary && (n == 0 || eCursorCmp(&c[n - 1], &c[i]) != 0)) {
+            c[n++] = c[i];
+        }
+    }
+    editorInfo.cursorCount = n;
+}
+
+//Index of the first extra cursor on line cy or below.
+int eCursorFirst(int cy) {
+    int lo = 0, hi = editorInfo.cursorCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (editorInfo.cursors[mid].cy < cy) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+//Leaves an extra cursor where the primary one is, before the primary one moves on.
+void eCursorPush() {
+    if (editorInfo.cursorCount == editorInfo.cursorCap) {
+        editorInfo.cursorCap = editorInfo.cursorCap ? editorInfo.cursorCap * 2 : 16;
+        editorInfo.cursors = (ecursor*)realloc(editorInfo.cursors, sizeof(ecursor) * editorInfo.cursorCap);
+    }
+
+    ++editorInfo.generation;
+    ecursor *c = &editorInfo.cursors[editorInfo.cursorCount++];
+    c->cx = editorInfo.cx;
+    c->cy = editorInfo.cy;
+    c->tx = editorInfo.tx;
+}
+
+//Adds a cursor at the same column on the next line.
+void eCursorAddBelow() {
+    if (editorInfo.cy + 1 >= editorInfo.linecount) {
+        eSetError("No line below");
+        return;
+    }
+
+    eCursorPush();
+    ++editorInfo.cy;
+    int size = editorInfo.line[editorInfo.cy].size;
+    editorInfo.cx = editorInfo.tx > editorInfo.cx ? editorInfo.tx : editorInfo.cx;
+    editorInfo.cx = editorInfo.cx > size ? size : editorInfo.cx;
+    eCursorSort();
+}
+
+bool eIsWordChar(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+//Adds a cursor at the next match of the word under the cursor, wrapping around at the end of the file.
+void eCursorAddMatch() {
+    if (editorInfo.cy >= editorInfo.linecount) {
+        eSetError("No word under the cursor");
+        return;
+    }
+
+    char *data = eLineDataTemp(&editorInfo.line[editorInfo.cy]);
+    int size = editorInfo.line[editorInfo.cy].size;
+    int start = editorInfo.cx, end = editorInfo.cx;
+    while (start > 0 && eIsWordChar(data[start - 1])) {
+        --start;
+    }
+    while (end < size && eIsWordChar(data[end])) {
+        ++end;
+    }
+    if (start == end) {
+        eSetError("No word under the cursor");
+        return;
+    }
+
+    int wlen = end - start;
+    int offset = editorInfo.cx - start;
+    char *word = (char*)malloc(wlen);
+    memcpy(word, &data[start], wlen);
+
+    int y = editorInfo.cy, from = end;
+    for (int n = 0; n <= editorInfo.linecount; ++n) {
+        eline *line = &editorInfo.line[y];
+        char *d = eLineDataTemp(line);
+        for (int x = from; x + wlen <= line->size; ++x) {
+            if (memcmp(&d[x], word, wlen) != 0 || (x > 0 && eIsWordChar(d[x - 1])) || (x + wlen < line->size && eIsWordChar(d[x + wlen]))) {
+                continue;
+            }
+
+            //Every match already has a cursor once the search comes back to one.
+            int f = eCursorFirst(y);
+            bool taken = y == editorInfo.cy && x == start;
+            for (; !taken && f < editorInfo.cursorCount && editorInfo.cursors[f].cy == y; ++f) {
+                taken = editorInfo.cursors[f].cx == x + offset;
+            }
+            if (taken) {
+                free(word);
+                eSetError("No more matches");
+                return;
+            }
+
+            eCursorPush();
+            editorInfo.cy = y;
+            editorInfo.cx = editorInfo.tx = x + offset;
+            eCursorSort();
+            eSetStatus("%d cursors", editorInfo.cursorCount + 1);
+            free(word);
+            return;
+        }
+
+        y = y + 1 < editorInfo.linecount ? y + 1 : 0;
+        from = 0;
+    }
+
+    free(word);
+    eSetError("No more matches");
+}
+
+//Applies one edit at every cursor on a line in a single pass. cur holds the line's cursors sorted by column. text is
+//inserted at each of them, or with del set, the char before (del < 0) or under (del > 0) each of them is removed.
+void eLineMultiEdit(eline *line, ecursor *cur, int count, const char *text, int len, int del) {
+    eLineOwn(line);
+    char *data = (char*)malloc(line->size + (del ? 0 : count * len) + 1);
+    int src = 0, dst = 0;
+    for (int i = 0; i < count; ++i) {
+        int cx = cur[i].cx > line->size ? line->size : cur[i].cx;
+        int at = del < 0 ? cx - 1 : cx;
+        if (at < src || (del && at >= line->size)) {
+            cur[i].cx = cur[i].tx = dst + cx - src;
+            continue;
+        }
+
+        memcpy(&data[dst], &line->data[src], at - src);
+        dst += at - src;
+        src = at;
+        if (del) {
+            eUndoRecord(UndoDelText, line->idx, dst, &line->data[src], 1);
+            ++src;
+        } else {
+            eUndoRecord(UndoInsText, line->idx, dst, text, len);
+            memcpy(&data[dst], text, len);
+            dst += len;
+        }
+        cur[i].cx = cur[i].tx = dst;
+    }
+
+    memcpy(&data[dst], &line->data[src], line->size - src);
+    dst += line->size - src;
+    data[dst] = '\0';
+    free(line->data);
+    line->data = data;
+    line->size = dst;
+    eUpdateLine(line);
+    ++editorInfo.dirty;
+}
+
+//Runs an edit at every cursor, the primary one included. Each touched line is rebuilt once.
+void eMultiEdit(const char *text, int len, int del) {
+    eCursorPush();
+    ecursor primary = editorInfo.cursors[editorInfo.cursorCount - 1];
+    ecursor *c = editorInfo.cursors;
+    qsort(c, editorInfo.cursorCount, sizeof(ecursor), eCursorCmp);
+
+    int p = 0;
+    while (eCursorCmp(&c[p], &primary) != 0) {
+        ++p;
+    }
+
+    for (int i = 0; i < editorInfo.cursorCount;) {
+        int j = i + 1;
+        while (j < editorInfo.cursorCount && c[j].cy == c[i].cy) {
+            ++j;
+        }
+
+        if (c[i].cy < editorInfo.linecount) {
+            eLineMultiEdit(&editorInfo.line[c[i].cy], &c[i], j - i, text, len, del);
+        }
+        i = j;
+    }
+
+    editorInfo.cx = editorInfo.tx = c[p].cx;
+    editorInfo.cy = c[p].cy;
+    memmove(&c[p], &c[p + 1], sizeof(ecursor) * (editorInfo.cursorCount - p - 1));
+    --editorInfo.cursorCount;
+    eCursorSort();
+}
+
+//Moves every cursor, the primary one included.
+void eMultiMove(int k) {
+    eCursorPush();
+    for (int i = 0; i < editorInfo.cursorCount; ++i) {
+        ecursor *c = &editorInfo.cursors[i];
+        editorInfo.cx = c->cx;
+        editorInfo.cy = c->cy;
+        editorInfo.tx = c->tx;
+        if (k == vk_home) {
+            editorInfo.cx = editorInfo.tx = 0;
+        } else if (k == vk_end) {
+            editorInfo.cx = editorInfo.tx = editorInfo.cy < editorInfo.linecount ? editorInfo.line[editorInfo.cy].size : 0;
+        } else {
+            eMove(k);
+        }
+        c->cx = editorInfo.cx;
+        c->cy = editorInfo.cy;
+        c->tx = editorInfo.tx;
+    }
+
+    //The primary cursor was pushed last.
+    --editorInfo.cursorCount;
+    eCursorSort();
+}
+
+//Handles the keys that act on every cursor while there are extra ones. Returns false if the key is left for the
+//caller, which then only acts on the primary cursor.
+bool eMultiKey(int k) {
+    if (k == vk_up || k == vk_down || k == vk_left || k == vk_right || k == vk_home || k == vk_end) {
+        eMultiMove(k);
+        return true;
+    } else if (editorInfo.mode != EDT) {
+        return false;
+    }
+
+    if (k == vk_backspace || k == CTRL_KEY('h') || k == vk_delete) {
+        eMultiEdit(NULL, 0, k == vk_delete ? 1 : -1);
+    } else if (k == vk_tab) {
+        const char *spaces = "        ";
+        bool tab = eUseTrueTab();
+        eMultiEdit(tab ? "\t" : spaces, tab ? 1 : TAB_SIZE, 0);
+    } else if (k == vk_enter) {
+        //Splitting lines under many cursors isn't supported, so it goes back to just the one.
+        editorInfo.cursorCount = 0;
+        ++editorInfo.generation;
+        return false;
+    } else if (k >= ' ' && k < 256 && k != 127) {
+        char ch = (char)k;
+        eMultiEdit(&ch, 1, 0);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 void eTick() {
+    int k = eReadKey();
+    eUndoBreak(k);
+
+    //Everything a key does is one transaction.
+    eBeginEdit();
+    eTickKey(k);
+    eCommitEdit();
+}
+
+void eTickKey(int k) {
     static int quitTimes = QUIT_TIMES;
 
-    int k = eReadKey();
+    if (editorInfo.cursorCount > 0 && eMultiKey(k)) {
+        quitTimes = QUIT_TIMES;
+        return;
+    }
 
     switch (k) {
-        case vk_escape: editorInfo.mode = !editorInfo.mode; break;
+        case vk_escape: keyCount = keyOp = 0; editorInfo.mode = view.active ? CMD : !editorInfo.mode; break;
         case vk_enter: if (editorInfo.mode == EDT) {eInsertNewLine();} break;
         case vk_tab: if (editorInfo.mode == EDT) {eInsertTab();} break;
 
         case CTRL_KEY('q'):{
-            if (editorInfo.dirty && quitTimes > 0) {
+            if (editorInfo.dirty && quitTimes > 0 && server.listen == -1) {
                 eSetError("No write since last change (%d more times to override)", quitTimes--);
                 return;
             } else {
@@ -1549,6 +7719,11 @@ void eTick() {
         case CTRL_KEY('B'): quit(); break;
         case CTRL_KEY('s'): eSave(); break;
         case CTRL_KEY('f'): eFind(); break;
+        case CTRL_KEY('r'): eRedo(); break;
+        case CTRL_KEY('n'): eCursorAddMatch(); break;
+        case CTRL_KEY('e'): eCursorAddBelow(); break;
+        case CTRL_KEY('c'): editorInfo.cursorCount = 0; ++editorInfo.generation; break;
+        case CTRL_KEY('w'): eWindowNext(); break;
 
         case vk_home: editorInfo.cx = 0; break;
         case vk_end: {
@@ -1560,7 +7735,8 @@ void eTick() {
         case vk_backspace:
         case CTRL_KEY('h'):
         case vk_delete: {
-            if (editorInfo.mode == EDT) {
+            if (editorInfo.mode == EDT && editorInfo.cy < editorInfo.linecount) {
+                eLineTouch(&editorInfo.line[editorInfo.cy]);
                 int count = 1;
                 int cx = editorInfo.cx;
                 while (count < TAB_SIZE && cx > 0 && editorInfo.line[editorInfo.cy].data[cx-- - 1] == ' ') {
@@ -1606,9 +7782,15 @@ void eTick() {
         default: {
             if (editorInfo.mode == EDT) {
                 eInsertChar(k);
-            } else {
+            } else if (view.active && (k == 'i' || k == 'I' || k == 'a' || k == 'A')) {
+                eSetError("'%s' is open read-only", editorInfo.filenameTrunc);
+            } else if (!eMacroKey(k) && !eLineOpKey(k)) {
                 switch (k) {
                     case ':': eCMD(); break;
+                    case 'u': eUndo(); break;
+                    case 'g': eGotoLine(0); break;
+                    case 'G': eGotoEnd(); break;
+                    case '%': eBracketJump(); break;
                     case 'i': editorInfo.mode = EDT; break;
                     case 'I': editorInfo.mode = EDT; eMoveToBeginningOfLine(editorInfo.cy); break;
                     case 'a': editorInfo.mode = EDT; eMove(vk_right); break;
@@ -1623,7 +7805,14 @@ void eTick() {
 }
 
 void resizeWindow() {
-    windowSize(&editorInfo.w, &editorInfo.h);
+    if (windowSize(&editorInfo.w, &editorInfo.h) == -1) {
+        return;
+    }
+    if (windows.count > 1) {
+        windows.screenW = editorInfo.w;
+        windows.screenH = editorInfo.h;
+        windows.full = true;
+    }
 
     if (editorInfo.cx > eWidth()) {
         editorInfo.cx = eWidth();
@@ -1634,7 +7823,9 @@ void resizeWindow() {
     }
 
     editorInfo.h -= 2;
-    ecls();
+
+    //Drawn once the handler has returned, since the frame goes through the render thread's lock.
+    needsRedraw = true;
 }
 
 void eInit() {
@@ -1645,9 +7836,14 @@ void eInit() {
     editorInfo.yoffset = 0;
     editorInfo.xoffset = 0;
     editorInfo.linecount = 0;
+    editorInfo.linecap = 0;
     editorInfo.line = NULL;
     editorInfo.dirty = 0;
     editorInfo.filename = NULL;
+    editorInfo.fileSize = 0;
+    editorInfo.fileMtime = 0;
+    editorInfo.diskChanged = false;
+    editorInfo.diskCheck = 0;
     editorInfo.filenameTrunc = NULL;
     editorInfo.statusmsg[0] = '\0';
     editorInfo.statusmsgTime = 0;
@@ -1657,6 +7853,28 @@ void eInit() {
     editorInfo.showLineNumbers = true;
     editorInfo.maxLineLen = 1;
     editorInfo.useTrueTab = false;
+    editorInfo.useTrigram = false;
+    editorInfo.trigram = NULL;
+    editorInfo.arena = NULL;
+    editorInfo.arenaSize = 0;
+    editorInfo.arenaRefs = 0;
+    editorInfo.compress = false;
+    editorInfo.zNext = 0;
+    editorInfo.zTouched = 0;
+    editorInfo.hlFrontier = 0;
+    editorInfo.hlResume = false;
+    editorInfo.brBlocks = NULL;
+    editorInfo.brBlockCount = 0;
+    editorInfo.brBlockCap = 0;
+    editorInfo.brHint = 0;
+    editorInfo.brHintStart = 0;
+    editorInfo.brDirty = true;
+    editorInfo.index = NULL;
+    memset(&editorInfo.undo, 0, sizeof(eundo));
+    editorInfo.undo.limit = UNDO_DEFAULT_LIMIT;
+    editorInfo.cursors = NULL;
+    editorInfo.cursorCount = 0;
+    editorInfo.cursorCap = 0;
 
     if (windowSize(&editorInfo.w, &editorInfo.h) == -1) {
         die("windowSize");
@@ -1668,36 +7886,364 @@ void eInit() {
 }
 
 void eReset() {
+    unsigned int generation = editorInfo.generation;
+    bool useTrigram = editorInfo.useTrigram;
+    bool compress = editorInfo.compress;
+    eStreamClose();
+    eFollowStop();
+    eViewClose();
+    eTrigramFree();
+    eUndoClear();
+    long long undoLimit = editorInfo.undo.limit;
+    free(editorInfo.cursors);
+    free(editorInfo.brBlocks);
+    if (editorInfo.index) {
+        free(editorInfo.index);
+    }
+
     if (editorInfo.linecount > 0) {
         for (int i = 0; i < editorInfo.linecount; ++i) {
-            free(editorInfo.line[i].data);
-            free(editorInfo.line[i].rdata);
-            free(editorInfo.line[i].hl);
+            eFreeLine(&editorInfo.line[i]);
         }
         
         free((eline*)editorInfo.line);
     }
-    
+
+    //eFreeLine releases the arena once the last line in it is gone, which leaves only an empty file's arena.
+    if (editorInfo.arena) {
+        editorInfo.arenaRefs = 1;
+        eArenaRelease();
+    }
+
     eInit();
+    editorInfo.generation = generation + 1;
+    editorInfo.useTrigram = useTrigram;
+    editorInfo.compress = compress;
+    editorInfo.undo.limit = undoLimit;
 }
 
-int main(int argc, char **argv) {
+//Keeps the piped in data on another fd and switches stdin over to the terminal for the keyboard.
+int eStdinToTTY() {
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+        perror("/dev/tty");
+        exit(EXIT_FAILURE);
+    }
+
+    close(tty);
+    return fd;
+}
+
+bool eIsFifo(char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+//Where a server listens, in the cache directory.
+bool eServerAddr(struct sockaddr_un *addr) {
+    char *dir = eCacheDir();
+    if (dir == NULL) {
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/server.sock", dir);
+    free(dir);
+    return len < (int)sizeof(addr->sun_path);
+}
+
+void eServerStop() {
+    unlink(server.path);
+}
+
+//Starts listening and goes into the background. Until a client attaches the screen is 80x24 and goes to /dev/null.
+void eServerStart() {
+    struct sockaddr_un addr;
+    if (!eServerAddr(&addr)) {
+        fprintf(stderr, "shabi: no cache directory to put the server's socket in\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //A socket left behind by a server that's gone gets replaced, but not one that still answers.
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "shabi: a server is already running at %s\n", addr.sun_path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    //The socket's permissions are the only thing stopping other users from driving the editor, so they can't be left
+    //to whatever umask the server was started with.
+    unlink(addr.sun_path);
+    mode_t mask = umask(077);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool bound = fd != -1 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, 8) == -1) {
+        perror(addr.sun_path);
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid > 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    if (null == -1 || pipe(server.attach) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    //Writing to a client that's gone only loses the frame.
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listen = fd;
+    server.w = 80;
+    server.h = 24;
+    strcpy(server.path, addr.sun_path);
+    atexit(eServerStop);
+}
+
+//Opens a file for a client. Paths are resolved so a file that's already resident is found by any name.
+//Takes the next client. Its hello says how big to draw and what to open, then its socket becomes the terminal.
+void eServerAccept() {
+    int fd = accept(server.listen, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1 || cred.uid != getuid()) {
+        close(fd);
+        return;
+    }
+
+    //Reads time out like the terminal's do, which is what lets a lone escape key through.
+    struct timeval tv = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    ehello hello;
+    char path[PATH_MAX];
+    if (recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) || hello.w <= 0 || hello.h <= 2 ||
+            hello.pathLen < 0 || hello.pathLen >= PATH_MAX ||
+            (hello.pathLen > 0 && recv(fd, path, hello.pathLen, MSG_WAITALL) != hello.pathLen)) {
+        close(fd);
+        return;
+    }
+    path[hello.pathLen] = '\0';
+
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    server.attached = true;
+    server.w = hello.w;
+    server.h = hello.h;
+    resizeWindow();
+    windows.full = true;
+    screen.full = true;
+
+    if (hello.pathLen > 0) {
+        eBufferOpen(path);
+    }
+
+    if (write(server.attach[1], "a", 1) == -1) {
+        die("write");
+    }
+
+    //The client's screen is empty until there's a frame, so that can't wait for the next redraw.
+    ecls();
+}
+
+//The client's gone. The render thread gets to finish with its socket first.
+void eServerDetach() {
+    eRenderFlush();
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    server.attached = false;
+}
+
+//Lets go of the client for a new one, telling it why first. The notice has to go between frames, but a client that's
+//stopped reading can't hold up the new one, so it's only waited on for a moment and then let go regardless.
+void eServerTakeover() {
+    const char notice[] = SERVER_NOTICE "taken over by another client\a";
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 200 * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        ++until.tv_sec;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&render.lock);
+    int err = 0;
+    while (render.writing && err == 0) {
+        err = pthread_cond_timedwait(&render.cond, &render.lock, &until);
+    }
+    if (!render.writing) {
+        send(STDOUT_FILENO, notice, sizeof(notice) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    shutdown(STDIN_FILENO, SHUT_RDWR);
+    pthread_mutex_unlock(&render.lock);
+}
+
+void eClientResize() {
+    clientResized = 1;
+}
+
+//Attaches this terminal to the server. Past sending it the hello, keys go one way and frames come back the other,
+//and that's all a client ever does.
+int eClient(char *filename) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || !eServerAddr(&addr) || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "shabi: no server to attach to (start one with --server)\n");
+        return EXIT_FAILURE;
+    }
+
+    //The server has its own working directory.
+    char path[PATH_MAX] = "";
+    if (filename && filename[0] != '/' && getcwd(path, sizeof(path) - 1)) {
+        strcat(path, "/");
+    }
+    if (filename) {
+        strncat(path, filename, sizeof(path) - strlen(path) - 1);
+    }
+
     enableRawMode();
+    ehello hello = {0, 0, (int)strlen(path)};
+    if (windowSize(&hello.w, &hello.h) == -1) {
+        die("windowSize");
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGWINCH, eClientResize);
+    struct iovec iov[2] = {{&hello, sizeof(hello)}, {path, hello.pathLen}};
+    if (!eWritev(fd, iov, 2)) {
+        die("write");
+    }
+
+    char buf[64 * 1024];
+    while (true) {
+        if (clientResized) {
+            clientResized = 0;
+            windowSize(&hello.w, &hello.h);
+            struct iovec msg = {buf, snprintf(buf, sizeof(buf), "\x1b[8;%d;%dt", hello.h, hello.w)};
+            eWritev(fd, &msg, 1);
+        }
+
+        struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            struct iovec keys = {buf, n};
+            if (n > 0 && !eWritev(fd, &keys, 1)) {
+                break;
+            }
+        }
+
+        if (pfd[1].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+
+            //The server's last words are kept for when the terminal is back to normal, or they'd be cleared with it.
+            int markLen = (int)strlen(SERVER_NOTICE);
+            for (char *p = buf; (p = (char*)memchr(p, '\x1b', buf + n - p)) != NULL; ++p) {
+                if (buf + n - p >= markLen && memcmp(p, SERVER_NOTICE, markLen) == 0) {
+                    char *text = p + markLen;
+                    char *end = (char*)memchr(text, '\a', buf + n - text);
+                    snprintf(clientNotice, sizeof(clientNotice), "%.*s", (int)((end ? end : buf + n) - text), text);
+                    n = p - buf;
+                    break;
+                }
+            }
+            struct iovec frame = {buf, n};
+            eWritev(STDOUT_FILENO, &frame, 1);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        return eClient(argc >= 3 ? argv[2] : NULL);
+    }
+
+    bool serve = argc >= 2 && strcmp(argv[1], "--server") == 0;
+    int stdinFd = -1;
+    if (serve) {
+        eServerStart();
+    } else {
+        if ((argc >= 2 && strcmp(argv[1], "-") == 0) || (argc < 2 && !isatty(STDIN_FILENO))) {
+            stdinFd = eStdinToTTY();
+        }
+
+        enableRawMode();
+    }
+
     eInit();
+    eInputStart();
+    eRenderStart();
 
     srand(time(NULL));
     eSetStatus(welcomeMsg[rand() % WELCOME_MSG_CNT]);
 
-    if (argc >= 2) {
-        eOpen(argv[1]);
+    if (serve) {
+        //Files named here are loaded before anyone asks for them.
+        for (int i = 2; i < argc; ++i) {
+            eBufferOpen(argv[i]);
+        }
+    } else if (stdinFd != -1) {
+        eStreamOpen(NULL, stdinFd);
+    } else if (argc >= 2 && eIsFifo(argv[1])) {
+        eStreamOpen(argv[1], -1);
+    } else if (argc >= 3 && strcmp(argv[1], "-R") == 0) {
+        eViewOpen(argv[2]);
+    } else if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+        eBufferOpen(argv[2]);
+        if (eFollowStart()) {
+            editorInfo.mode = CMD;
+            editorInfo.cy = editorInfo.linecount > 0 ? editorInfo.linecount - 1 : 0;
+        }
+    } else if (argc >= 3 && argv[1][0] == '+') {
+        eBufferOpen(argv[2]);
+        eGotoLine(atoll(&argv[1][1]) - 1);
+    } else if (argc >= 2) {
+        eBufferOpen(argv[1]);
     }
 
     if (editorInfo.filename == NULL) {
         editorInfo.mode = CMD;
     }
 
+    //Keys that are already queued get handled before the next frame is drawn.
     while (true) {
-        ecls();
+        if (!eInputPending()) {
+            ecls();
+        }
         eTick();
     }
 